@@ -0,0 +1,400 @@
+#include "batch.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gmp.h>
+
+// Initializes an empty batch key
+void batch_key_init(batch_key *key) {
+    key->count = 0;
+    mpz_inits(key->n, key->p, key->q, key->qinv, NULL);
+}
+
+// Picks the count smallest odd primes that are coprime to (p - 1)(q - 1)
+// Distinct primes are pairwise coprime, which the batch tree needs
+void batch_make_exps(batch_key *key, uint32_t count) {
+    mpz_t e, pminus1, qminus1, totient, g;
+    mpz_inits(e, pminus1, qminus1, totient, g, NULL);
+    mpz_sub_ui(pminus1, key->p, 1);
+    mpz_sub_ui(qminus1, key->q, 1);
+    mpz_mul(totient, pminus1, qminus1);
+    mpz_set_ui(e, 2);
+    key->count = 0;
+
+    while (key->count < count) {
+        mpz_nextprime(e, e);
+        gcd(g, e, totient);
+
+        if (mpz_cmp_ui(g, 1) == 0) {
+            key->exps[key->count++] = mpz_get_ui(e);
+        }
+    }
+
+    mpz_clears(e, pminus1, qminus1, totient, g, NULL);
+}
+
+// Sets e to the product of the first count exponents
+void batch_product(mpz_t e, batch_key *key, size_t count) {
+    mpz_set_ui(e, 1);
+
+    for (size_t i = 0; i < count; i++) {
+        mpz_mul_ui(e, e, key->exps[i]);
+    }
+}
+
+// Writes n, the exponent count and exponents, the signature and the username in hex
+void batch_write_pub(batch_key *key, mpz_t s, char username[], FILE *pbfile) {
+    uint64_t start = stats_start();
+    gmp_fprintf(pbfile, "%Zx\n%" PRIx32 "\n", key->n, key->count);
+
+    for (uint32_t i = 0; i < key->count; i++) {
+        fprintf(pbfile, "%" PRIx64 "\n", key->exps[i]);
+    }
+
+    gmp_fprintf(pbfile, "%Zx\n%s\n", s, username);
+    stats_stop(STAT_TIME_KEY_IO, start);
+}
+
+// Reads the exponent count and exponents, rejecting counts the key can't hold
+static bool read_exps(batch_key *key, FILE *keyfile) {
+    if (fscanf(keyfile, "%" SCNx32 "\n", &key->count) != 1 || key->count == 0
+        || key->count > BATCH_MAX_EXPS) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < key->count; i++) {
+        if (fscanf(keyfile, "%" SCNx64 "\n", &key->exps[i]) != 1 || key->exps[i] < 3) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Reads a public batch key
+bool batch_read_pub(batch_key *key, mpz_t s, char username[], FILE *pbfile) {
+    uint64_t start = stats_start();
+    bool ok = gmp_fscanf(pbfile, "%Zx\n", key->n) == 1 && read_exps(key, pbfile)
+              && gmp_fscanf(pbfile, "%Zx\n%s\n", s, username) == 2;
+    stats_stop(STAT_TIME_KEY_IO, start);
+    return ok;
+}
+
+// Writes n, p, q and the exponents in hex
+// Each block's private exponent is derived from p and q when the key is read
+void batch_write_priv(batch_key *key, FILE *pvfile) {
+    uint64_t start = stats_start();
+    gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%" PRIx32 "\n", key->n, key->p, key->q, key->count);
+
+    for (uint32_t i = 0; i < key->count; i++) {
+        fprintf(pvfile, "%" PRIx64 "\n", key->exps[i]);
+    }
+
+    stats_stop(STAT_TIME_KEY_IO, start);
+}
+
+// Reads a private batch key and precomputes q^-1 mod p for CRT
+bool batch_read_priv(batch_key *key, FILE *pvfile) {
+    uint64_t start = stats_start();
+    bool ok = gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", key->n, key->p, key->q) == 3
+              && read_exps(key, pvfile);
+    stats_stop(STAT_TIME_KEY_IO, start);
+
+    if (!ok) {
+        return false;
+    }
+
+    mpz_t pq;
+    mpz_init(pq);
+    mpz_mul(pq, key->p, key->q);
+    ok = mpz_cmp(pq, key->n) == 0;
+    mod_inverse(key->qinv, key->q, key->p);
+    mpz_clear(pq);
+    return ok && mpz_cmp_ui(key->qinv, 0) != 0;
+}
+
+// Sets o = v^(1/e) mod n through CRT with exponents e^-1 mod (p - 1) and (q - 1)
+static void batch_root(mpz_t o, mpz_t v, mpz_t e, batch_key *key) {
+    mpz_t dp, dq, pminus1, qminus1;
+    mpz_inits(dp, dq, pminus1, qminus1, NULL);
+    mpz_sub_ui(pminus1, key->p, 1);
+    mpz_sub_ui(qminus1, key->q, 1);
+    mod_inverse(dp, e, pminus1);
+    mod_inverse(dq, e, qminus1);
+    rsa_decrypt_crt(o, v, key->p, key->q, dp, dq, key->qinv);
+    mpz_clears(dp, dq, pminus1, qminus1, NULL);
+}
+
+// Raises a to an exponent that is small but may not fit in an unsigned long
+static void small_pow(mpz_t o, mpz_t a, mpz_t e, mpz_t n) {
+    if (mpz_fits_ulong_p(e)) {
+        pow_mod_ui(o, a, mpz_get_ui(e), n);
+    } else {
+        pow_mod(o, a, e, n);
+    }
+}
+
+// Node of the batch tree over the ciphertexts lo..hi-1
+// e is the product E of their exponents and v the product of c_i^(E / e_i)
+typedef struct batch_node {
+    mpz_t e, v;
+    size_t index;
+    struct batch_node *left, *right;
+} batch_node;
+
+static void free_tree(batch_node *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    free_tree(node->left);
+    free_tree(node->right);
+    mpz_clears(node->e, node->v, NULL);
+    free(node);
+}
+
+// Percolates the ciphertexts up: v = v_L^(E_R) * v_R^(E_L), E = E_L * E_R
+static batch_node *percolate_up(mpz_t *c, size_t lo, size_t hi, batch_key *key) {
+    batch_node *node = (batch_node *) calloc(1, sizeof(batch_node));
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    mpz_inits(node->e, node->v, NULL);
+    node->index = lo;
+
+    if (hi - lo == 1) {
+        mpz_set_ui(node->e, key->exps[lo % key->count]);
+        mpz_mod(node->v, c[lo], key->n);
+        return node;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    node->left = percolate_up(c, lo, mid, key);
+    node->right = percolate_up(c, mid, hi, key);
+
+    if (node->left == NULL || node->right == NULL) {
+        free_tree(node);
+        return NULL;
+    }
+
+    mpz_t t;
+    mpz_init(t);
+    small_pow(node->v, node->left->v, node->right->e, key->n);
+    small_pow(t, node->right->v, node->left->e, key->n);
+    mpz_mul(node->v, node->v, t);
+    mpz_mod(node->v, node->v, key->n);
+    mpz_mul(node->e, node->left->e, node->right->e);
+    mpz_clear(t);
+    return node;
+}
+
+// Splits r = v^(1/E) into the roots of the two subtrees and recurses down to the messages
+// With X = 0 mod E_L and X = 1 mod E_R: r_R = r^X / (v_L^(X / E_L) * v_R^((X - 1) / E_R))
+// Returns false if an inverse mod n doesn't exist, which only malformed input can cause
+static bool percolate_down(batch_node *node, mpz_t r, mpz_t *m, batch_key *key) {
+    if (node->left == NULL) {
+        mpz_set(m[node->index], r);
+        return true;
+    }
+
+    batch_node *left = node->left, *right = node->right;
+    mpz_t x, t, u, r_left, r_right;
+    mpz_inits(x, t, u, r_left, r_right, NULL);
+
+    // X = E_L * (E_L^-1 mod E_R)
+    mod_inverse(x, left->e, right->e);
+    mpz_mul(x, x, left->e);
+
+    mpz_divexact(t, x, left->e);
+    small_pow(t, left->v, t, key->n);
+    mpz_sub_ui(u, x, 1);
+    mpz_divexact(u, u, right->e);
+    small_pow(u, right->v, u, key->n);
+    mpz_mul(t, t, u);
+    mpz_mod(t, t, key->n);
+    mod_inverse(u, t, key->n);
+
+    small_pow(r_right, r, x, key->n);
+    mpz_mul(r_right, r_right, u);
+    mpz_mod(r_right, r_right, key->n);
+
+    // r_L = r / r_R
+    mod_inverse(t, r_right, key->n);
+    mpz_mul(r_left, r, t);
+    mpz_mod(r_left, r_left, key->n);
+
+    bool ok = mpz_cmp_ui(u, 0) != 0 && mpz_cmp_ui(t, 0) != 0
+              && percolate_down(left, r_left, m, key) && percolate_down(right, r_right, m, key);
+    mpz_clears(x, t, u, r_left, r_right, NULL);
+    return ok;
+}
+
+// Fiat's batch RSA: decrypts count ciphertexts, c[i] encrypted under exps[i % key->count]
+// Costs one full-size root at the top of the tree plus small-exponent work at each node
+// Returns false if the tree couldn't be built or used; each message is then decrypted on its own
+bool batch_decrypt(mpz_t *m, mpz_t *c, size_t count, batch_key *key) {
+    batch_node *root = percolate_up(c, 0, count, key);
+    bool ok = root != NULL;
+    mpz_t r;
+    mpz_init(r);
+
+    if (ok) {
+        batch_root(r, root->v, root->e, key);
+        ok = percolate_down(root, r, m, key);
+    }
+
+    free_tree(root);
+
+    for (size_t i = 0; !ok && i < count; i++) {
+        mpz_set_ui(r, key->exps[i % key->count]);
+        batch_root(m[i], c[i], r, key);
+    }
+
+    mpz_clear(r);
+    return ok;
+}
+
+// Bytes of file data carried by each padded block of k bytes, or 0 if k is too small
+// A block is 0xFF, the data length in two bytes, the data, then at least max(16, k / 4)
+// random bytes filling it out to k bytes
+static size_t block_capacity(size_t k) {
+    size_t pad = k / 4 > 16 ? k / 4 : 16;
+    size_t capacity = k > pad + 3 ? k - pad - 3 : 0;
+    return capacity > 0xFFFF ? 0xFFFF : capacity;
+}
+
+// Encrypts a file, padding every block to the full k bytes with fresh random bytes
+// The exponent rotates through the key's exponents from block to block
+// Unpadded blocks would fall to an integer root under the small exponents, and repeated
+// blocks under two coprime exponents would fall to the common-modulus attack
+// Returns false if the key is too small to pad, or memory or /dev/urandom is unavailable
+bool batch_encrypt_file(FILE *infile, FILE *outfile, batch_key *key) {
+    size_t k = (mpz_sizeinbase(key->n, 2) - 1) / 8, capacity = block_capacity(k);
+    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    FILE *urandom = fopen("/dev/urandom", "rb");
+
+    if (capacity == 0 || block == NULL || urandom == NULL) {
+        free(block);
+
+        if (urandom != NULL) {
+            fclose(urandom);
+        }
+
+        return false;
+    }
+
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    block[0] = 0xFF;
+
+    uint64_t j = 0, index = 0;
+    bool padded = true;
+
+    // Reads and writes count as I/O time, padding, import and encryption as math time
+    while (padded && feof(infile) == 0) {
+        uint64_t start = stats_start();
+        j = fread(block + 3, sizeof(uint8_t), capacity, infile);
+        stats_stop(STAT_TIME_IO, start);
+
+        start = stats_start();
+        block[1] = (uint8_t) (j >> 8);
+        block[2] = (uint8_t) j;
+        padded = fread(block + 3 + j, sizeof(uint8_t), k - 3 - j, urandom) == k - 3 - j;
+        mpz_import(m, k, 1, sizeof(uint8_t), 1, 0, block);
+        pow_mod_ui(c, m, key->exps[index % key->count], key->n);
+        stats_stop(STAT_TIME_MATH, start);
+
+        start = stats_start();
+        gmp_fprintf(outfile, "%Zx\n", c);
+        stats_stop(STAT_TIME_IO, start);
+        stats_count(STAT_BYTES, j);
+        stats_count(STAT_BLOCKS, 1);
+        index += 1;
+    }
+
+    mpz_clears(m, c, NULL);
+    fclose(urandom);
+    free(block);
+    return padded;
+}
+
+// Decrypts a file written by batch_encrypt_file, stripping the padding from each block
+// Blocks are taken key->count at a time, so each group holds one block per exponent
+// Returns false on a block that isn't well formed or if memory is unavailable
+bool batch_decrypt_file(FILE *infile, FILE *outfile, batch_key *key) {
+    size_t k = (mpz_sizeinbase(key->n, 2) - 1) / 8, capacity = block_capacity(k), ptr;
+    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    mpz_t m[BATCH_MAX_EXPS], c[BATCH_MAX_EXPS];
+    bool ok = block != NULL && capacity != 0;
+
+    for (uint32_t i = 0; i < key->count; i++) {
+        mpz_inits(m[i], c[i], NULL);
+    }
+
+    // Scanning and writing count as I/O time, the batch tree and export as math time
+    while (ok && feof(infile) == 0) {
+        size_t count = 0;
+        uint64_t start = stats_start();
+
+        while (ok && count < key->count && feof(infile) == 0) {
+            ok = gmp_fscanf(infile, "%Zx\n", c[count]) == 1;
+            count += 1;
+        }
+
+        stats_stop(STAT_TIME_IO, start);
+
+        if (!ok) {
+            break;
+        }
+
+        start = stats_start();
+        batch_decrypt(m, c, count, key);
+        stats_stop(STAT_TIME_MATH, start);
+
+        for (size_t i = 0; ok && i < count; i++) {
+            // A padded block is exactly k bytes and starts with 0xFF
+            // Checking the size first also keeps the export inside the buffer
+            start = stats_start();
+            size_t len = 0;
+            ok = mpz_sizeinbase(m[i], 256) == k;
+
+            if (ok) {
+                mpz_export(block, &ptr, 1, sizeof(uint8_t), 1, 0, m[i]);
+                len = (size_t) block[1] << 8 | block[2];
+                ok = block[0] == 0xFF && len <= capacity;
+            }
+
+            stats_stop(STAT_TIME_MATH, start);
+
+            if (ok) {
+                start = stats_start();
+                fwrite(block + 3, sizeof(uint8_t), len, outfile);
+                stats_stop(STAT_TIME_IO, start);
+                stats_count(STAT_BYTES, len);
+            }
+        }
+
+        stats_count(STAT_BLOCKS, count);
+    }
+
+    for (uint32_t i = 0; i < key->count; i++) {
+        mpz_clears(m[i], c[i], NULL);
+    }
+
+    free(block);
+    return ok;
+}
+
+// Frees the memory of a batch key
+void batch_key_clear(batch_key *key) {
+    mpz_clears(key->n, key->p, key->q, key->qinv, NULL);
+    key->count = 0;
+}
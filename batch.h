@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#define BATCH_MAX_EXPS 64
+
+// One modulus shared by a set of small, pairwise coprime public exponents
+// Block j of a file is padded with random bytes and encrypted under exps[j % count]
+// p, q and qinv are only set for a private key
+typedef struct {
+    uint32_t count;
+    uint64_t exps[BATCH_MAX_EXPS];
+    mpz_t n, p, q, qinv;
+} batch_key;
+
+void batch_key_init(batch_key *key);
+
+void batch_make_exps(batch_key *key, uint32_t count);
+
+void batch_product(mpz_t e, batch_key *key, size_t count);
+
+void batch_write_pub(batch_key *key, mpz_t s, char username[], FILE *pbfile);
+
+bool batch_read_pub(batch_key *key, mpz_t s, char username[], FILE *pbfile);
+
+void batch_write_priv(batch_key *key, FILE *pvfile);
+
+bool batch_read_priv(batch_key *key, FILE *pvfile);
+
+bool batch_decrypt(mpz_t *m, mpz_t *c, size_t count, batch_key *key);
+
+bool batch_encrypt_file(FILE *infile, FILE *outfile, batch_key *key);
+
+bool batch_decrypt_file(FILE *infile, FILE *outfile, batch_key *key);
+
+void batch_key_clear(batch_key *key);
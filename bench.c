@@ -0,0 +1,485 @@
+#include "batch.h"
+#include "numtheory.h"
+#include "randstate.h"
+#include "rsa.h"
+#include "tune.h"
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#define OPTIONS "hjs:r:b:p:f:o:"
+
+// Modulus sizes and plaintext sizes covered by the suite
+static const uint64_t modulus_bits[] = { 1024, 2048, 4096, 8192 };
+static const size_t file_sizes[] = { 1024, 4096, 16384, 65536 };
+
+// Profiles the file round trips run under: the untuned default, then each kernel fanned out
+// over 4 threads in batches of 8 blocks
+static const tune_profile file_profiles[] = {
+    { TUNE_KERNEL_BINARY, 1, 1, 1 },
+    { TUNE_KERNEL_BINARY, 1, 4, 8 },
+    { TUNE_KERNEL_WINDOW, 4, 4, 8 },
+    { TUNE_KERNEL_GMP, 1, 4, 8 },
+};
+
+#define NUM_MODULI   (sizeof(modulus_bits) / sizeof(modulus_bits[0]))
+#define NUM_SIZES    (sizeof(file_sizes) / sizeof(file_sizes[0]))
+#define NUM_PROFILES (sizeof(file_profiles) / sizeof(file_profiles[0]))
+
+static bool json_output = false;
+static bool all_passed = true;
+static uint64_t num_records = 0;
+
+// Returns the current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Writes one result as a CSV row or a JSON object
+static void report(FILE *out, const char *name, uint64_t bits, size_t bytes, uint64_t reps,
+    uint64_t total_ns, bool check) {
+    uint64_t per_op = reps != 0 ? total_ns / reps : 0;
+
+    if (json_output) {
+        fprintf(out,
+            "%s\n  {\"benchmark\": \"%s\", \"bits\": %" PRIu64 ", \"bytes\": %zu, "
+            "\"reps\": %" PRIu64 ", \"ns_total\": %" PRIu64 ", \"ns_per_op\": %" PRIu64
+            ", \"check\": \"%s\"}",
+            num_records == 0 ? "" : ",", name, bits, bytes, reps, total_ns, per_op,
+            check ? "pass" : "FAIL");
+    } else {
+        fprintf(out, "%s,%" PRIu64 ",%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s\n", name, bits,
+            bytes, reps, total_ns, per_op, check ? "pass" : "FAIL");
+    }
+
+    if (!check) {
+        fprintf(stderr, "bench: %s (%" PRIu64 " bits) disagrees with GMP\n", name, bits);
+        all_passed = false;
+    }
+
+    num_records += 1;
+    fflush(out);
+}
+
+// Builds a key of exactly bits bits with GMP primitives so setup stays cheap
+// e is drawn at random below the totient just like rsa_make_pub does
+static void make_key(mpz_t p, mpz_t q, mpz_t n, mpz_t e, mpz_t d, uint64_t bits) {
+    mpz_t totient, pminus1, qminus1, g;
+    mpz_inits(totient, pminus1, qminus1, g, NULL);
+
+    do {
+        mpz_urandomb(p, state, bits / 2);
+        mpz_setbit(p, bits / 2 - 1);
+        mpz_setbit(p, bits / 2 - 2);
+        mpz_nextprime(p, p);
+        mpz_urandomb(q, state, bits - bits / 2);
+        mpz_setbit(q, bits - bits / 2 - 1);
+        mpz_setbit(q, bits - bits / 2 - 2);
+        mpz_nextprime(q, q);
+        mpz_mul(n, p, q);
+    } while (mpz_cmp(p, q) == 0 || mpz_sizeinbase(n, 2) != bits);
+
+    mpz_sub_ui(pminus1, p, 1);
+    mpz_sub_ui(qminus1, q, 1);
+    mpz_mul(totient, pminus1, qminus1);
+
+    do {
+        mpz_urandomm(e, state, totient);
+        mpz_add_ui(e, e, 1);
+        mpz_gcd(g, e, totient);
+    } while (mpz_cmp_ui(g, 1) != 0);
+
+    rsa_make_priv(d, e, p, q);
+    mpz_clears(totient, pminus1, qminus1, g, NULL);
+}
+
+// pow_mod against mpz_powm on random base and exponent below n
+static void bench_pow_mod(FILE *out, mpz_t n, uint64_t bits, uint64_t reps) {
+    mpz_t a, d, o, expected;
+    mpz_inits(a, d, o, expected, NULL);
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t i = 0; i < reps; i++) {
+        mpz_urandomm(a, state, n);
+        mpz_urandomm(d, state, n);
+        uint64_t start = now_ns();
+        pow_mod(o, a, d, n);
+        total += now_ns() - start;
+        mpz_powm(expected, a, d, n);
+        check = check && mpz_cmp(o, expected) == 0;
+    }
+
+    report(out, "pow_mod", bits, 0, reps, total, check);
+    mpz_clears(a, d, o, expected, NULL);
+}
+
+// pow_mod_window against mpz_powm for every window width the autotuner considers
+static void bench_pow_mod_window(FILE *out, mpz_t n, uint64_t bits, uint64_t reps) {
+    mpz_t a, d, o, expected;
+    mpz_inits(a, d, o, expected, NULL);
+    char name[32];
+
+    for (uint32_t w = 2; w <= 6; w++) {
+        uint64_t total = 0;
+        bool check = true;
+
+        for (uint64_t i = 0; i < reps; i++) {
+            mpz_urandomm(a, state, n);
+            mpz_urandomm(d, state, n);
+            uint64_t start = now_ns();
+            pow_mod_window(o, a, d, n, w);
+            total += now_ns() - start;
+            mpz_powm(expected, a, d, n);
+            check = check && mpz_cmp(o, expected) == 0;
+        }
+
+        snprintf(name, sizeof(name), "pow_mod_window%" PRIu32, w);
+        report(out, name, bits, 0, reps, total, check);
+    }
+
+    mpz_clears(a, d, o, expected, NULL);
+}
+
+// pow_mod_ui against mpz_powm_ui with the standard public exponent 65537
+static void bench_pow_mod_ui(FILE *out, mpz_t n, uint64_t bits, uint64_t reps) {
+    mpz_t a, o, expected;
+    mpz_inits(a, o, expected, NULL);
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t i = 0; i < reps; i++) {
+        mpz_urandomm(a, state, n);
+        uint64_t start = now_ns();
+        pow_mod_ui(o, a, 65537, n);
+        total += now_ns() - start;
+        mpz_powm_ui(expected, a, 65537, n);
+        check = check && mpz_cmp(o, expected) == 0;
+    }
+
+    report(out, "pow_mod_ui", bits, 0, reps, total, check);
+    mpz_clears(a, o, expected, NULL);
+}
+
+// batch_decrypt on one message per exponent, checked against the original messages
+// Each repetition decrypts BENCH_BATCH messages with one full-size root
+#define BENCH_BATCH 8
+
+static void bench_batch_decrypt(FILE *out, mpz_t p, mpz_t q, mpz_t n, uint64_t bits,
+    uint64_t reps) {
+    batch_key key;
+    batch_key_init(&key);
+    mpz_set(key.n, n);
+    mpz_set(key.p, p);
+    mpz_set(key.q, q);
+    mod_inverse(key.qinv, q, p);
+    batch_make_exps(&key, BENCH_BATCH);
+
+    mpz_t m[BENCH_BATCH], c[BENCH_BATCH], o[BENCH_BATCH];
+    uint64_t total = 0;
+    bool check = true;
+
+    for (size_t i = 0; i < BENCH_BATCH; i++) {
+        mpz_inits(m[i], c[i], o[i], NULL);
+    }
+
+    for (uint64_t r = 0; r < reps; r++) {
+        for (size_t i = 0; i < BENCH_BATCH; i++) {
+            mpz_urandomm(m[i], state, n);
+            mpz_powm_ui(c[i], m[i], key.exps[i], n);
+        }
+
+        uint64_t start = now_ns();
+        check = batch_decrypt(o, c, BENCH_BATCH, &key) && check;
+        total += now_ns() - start;
+
+        for (size_t i = 0; i < BENCH_BATCH; i++) {
+            check = check && mpz_cmp(o[i], m[i]) == 0;
+        }
+    }
+
+    report(out, "batch_decrypt", bits, 0, reps, total, check);
+
+    for (size_t i = 0; i < BENCH_BATCH; i++) {
+        mpz_clears(m[i], c[i], o[i], NULL);
+    }
+
+    batch_key_clear(&key);
+}
+
+// gcd against mpz_gcd on random operands of the modulus size
+static void bench_gcd(FILE *out, uint64_t bits, uint64_t reps) {
+    mpz_t a, b, g, expected;
+    mpz_inits(a, b, g, expected, NULL);
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t i = 0; i < reps; i++) {
+        mpz_urandomb(a, state, bits);
+        mpz_urandomb(b, state, bits);
+        uint64_t start = now_ns();
+        gcd(g, a, b);
+        total += now_ns() - start;
+        mpz_gcd(expected, a, b);
+        check = check && mpz_cmp(g, expected) == 0;
+    }
+
+    report(out, "gcd", bits, 0, reps, total, check);
+    mpz_clears(a, b, g, expected, NULL);
+}
+
+// mod_inverse against mpz_invert, including inputs that have no inverse
+static void bench_mod_inverse(FILE *out, mpz_t n, uint64_t bits, uint64_t reps) {
+    mpz_t a, i, expected;
+    mpz_inits(a, i, expected, NULL);
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t r = 0; r < reps; r++) {
+        mpz_urandomm(a, state, n);
+        uint64_t start = now_ns();
+        mod_inverse(i, a, n);
+        total += now_ns() - start;
+
+        if (mpz_invert(expected, a, n) == 0) {
+            mpz_set_ui(expected, 0);
+        }
+
+        check = check && mpz_cmp(i, expected) == 0;
+    }
+
+    report(out, "mod_inverse", bits, 0, reps, total, check);
+    mpz_clears(a, i, expected, NULL);
+}
+
+// is_prime on a known prime and a known composite against mpz_probab_prime_p
+static void bench_is_prime(FILE *out, mpz_t p, mpz_t n, uint64_t iters, uint64_t reps) {
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t i = 0; i < reps; i++) {
+        uint64_t start = now_ns();
+        bool prime = is_prime(p, iters);
+        bool composite = !is_prime(n, iters);
+        total += now_ns() - start;
+        check = check && prime == (mpz_probab_prime_p(p, 25) != 0) && composite;
+    }
+
+    report(out, "is_prime", mpz_sizeinbase(p, 2), 0, reps, total, check);
+}
+
+// make_prime for prime sizes of half the modulus
+static void bench_make_prime(FILE *out, uint64_t bits, uint64_t iters, uint64_t reps) {
+    mpz_t p;
+    mpz_init(p);
+    uint64_t total = 0;
+    bool check = true;
+
+    for (uint64_t i = 0; i < reps; i++) {
+        uint64_t start = now_ns();
+        make_prime(p, bits, iters);
+        total += now_ns() - start;
+        check = check && mpz_probab_prime_p(p, 25) != 0 && mpz_sizeinbase(p, 2) == bits;
+    }
+
+    report(out, "make_prime", bits, 0, reps, total, check);
+    mpz_clear(p);
+}
+
+// Checks that dfile holds exactly the size bytes of plain
+static bool same_output(FILE *dfile, const uint8_t *plain, uint8_t *result, size_t size) {
+    fflush(dfile);
+    rewind(dfile);
+    size_t got = fread(result, sizeof(uint8_t), size + 1, dfile);
+    return got == size && memcmp(plain, result, size) == 0;
+}
+
+// Round trips size bytes of random data through rsa_encrypt_file, rsa_decrypt_file and
+// rsa_decrypt_file_crt under each file profile
+// Results under the default profile keep the plain names; the others get the profile appended
+static void bench_file(
+    FILE *out, mpz_t p, mpz_t q, mpz_t n, mpz_t e, mpz_t d, uint64_t bits, size_t size) {
+    uint8_t *plain = (uint8_t *) malloc(size);
+    uint8_t *result = (uint8_t *) malloc(size + 1);
+    FILE *pfile = tmpfile();
+
+    if (plain == NULL || result == NULL || pfile == NULL) {
+        fprintf(stderr, "bench: failed to allocate %zu byte workload\n", size);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        plain[i] = (uint8_t) gmp_urandomb_ui(state, 8);
+    }
+
+    fwrite(plain, sizeof(uint8_t), size, pfile);
+
+    // dp = d mod (p - 1), dq = d mod (q - 1), qinv = q^-1 mod p
+    mpz_t dp, dq, qinv;
+    mpz_inits(dp, dq, qinv, NULL);
+    mpz_sub_ui(dp, p, 1);
+    mpz_mod(dp, d, dp);
+    mpz_sub_ui(dq, q, 1);
+    mpz_mod(dq, d, dq);
+    mod_inverse(qinv, q, p);
+
+    for (size_t i = 0; i < NUM_PROFILES; i++) {
+        FILE *cfile = tmpfile(), *dfile = tmpfile(), *crtfile = tmpfile();
+        char suffix[48] = "", name[96];
+
+        if (cfile == NULL || dfile == NULL || crtfile == NULL) {
+            fprintf(stderr, "bench: failed to allocate %zu byte workload\n", size);
+            exit(1);
+        }
+
+        tune_active = file_profiles[i];
+
+        if (i != 0) {
+            snprintf(suffix, sizeof(suffix), "_%s_t%" PRIu32 "_b%" PRIu32,
+                tune_kernel_name(tune_active.kernel), tune_active.threads, tune_active.batch);
+        }
+
+        rewind(pfile);
+        uint64_t start = now_ns();
+        bool encrypted = rsa_encrypt_file(pfile, cfile, n, e);
+        fflush(cfile);
+        uint64_t encrypt_ns = now_ns() - start;
+
+        rewind(cfile);
+        start = now_ns();
+        bool decrypted = rsa_decrypt_file(cfile, dfile, n, d);
+        fflush(dfile);
+        uint64_t decrypt_ns = now_ns() - start;
+
+        rewind(cfile);
+        start = now_ns();
+        bool crt_decrypted = rsa_decrypt_file_crt(cfile, crtfile, n, p, q, dp, dq, qinv);
+        fflush(crtfile);
+        uint64_t crt_ns = now_ns() - start;
+
+        bool check = encrypted && decrypted && same_output(dfile, plain, result, size);
+        bool crt_check = encrypted && crt_decrypted && same_output(crtfile, plain, result, size);
+
+        snprintf(name, sizeof(name), "rsa_encrypt_file%s", suffix);
+        report(out, name, bits, size, 1, encrypt_ns, check && crt_check);
+        snprintf(name, sizeof(name), "rsa_decrypt_file%s", suffix);
+        report(out, name, bits, size, 1, decrypt_ns, check);
+        snprintf(name, sizeof(name), "rsa_decrypt_file_crt%s", suffix);
+        report(out, name, bits, size, 1, crt_ns, crt_check);
+
+        fclose(cfile);
+        fclose(dfile);
+        fclose(crtfile);
+    }
+
+    tune_active = file_profiles[0];
+    mpz_clears(dp, dq, qinv, NULL);
+    fclose(pfile);
+    free(plain);
+    free(result);
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    bool print_usage = false;
+    uint64_t seed = 2022, reps = 3, max_bits = 8192, max_prime_bits = 2048;
+    size_t max_size = 16384;
+    char *outfile_name = NULL;
+    FILE *oFile = stdout;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h': print_usage = true; break;
+        case 'j': json_output = true; break;
+        case 's': seed = strtoull(optarg, NULL, 10); break;
+        case 'r': reps = strtoull(optarg, NULL, 10); break;
+        case 'b': max_bits = strtoull(optarg, NULL, 10); break;
+        case 'p': max_prime_bits = strtoull(optarg, NULL, 10); break;
+        case 'f': max_size = strtoull(optarg, NULL, 10); break;
+        case 'o': outfile_name = optarg; break;
+        default: print_usage = true; break;
+        }
+    }
+
+    if (print_usage) {
+        printf("SYNOPSIS\n");
+        printf("   Microbenchmarks the number theory and RSA hot paths.\n");
+        printf("   Every result is checked against the equivalent GMP routine.\n\n");
+        printf("USAGE\n");
+        printf("   ./benchmark [-hj] [-s seed] [-r reps] [-b bits] [-p bits] [-f bytes] [-o "
+               "outfile]\n\n");
+        printf("OPTIONS\n");
+        printf("   -h              Display program help and usage.\n");
+        printf("   -j              Report results as JSON (default: CSV).\n");
+        printf("   -s seed         Random seed for operands and keys (default: 2022).\n");
+        printf("   -r reps         Repetitions per kernel measurement (default: 3).\n");
+        printf("   -b bits         Largest modulus to benchmark (default: 8192).\n");
+        printf("   -p bits         Largest modulus whose primes make_prime builds (default: "
+               "2048).\n");
+        printf("   -f bytes        Largest file to round trip (default: 16384).\n");
+        printf("   -o outfile      Output file for results (default: stdout).\n");
+        return 0;
+    }
+
+    if (outfile_name != NULL) {
+        oFile = fopen(outfile_name, "w");
+
+        if (oFile == NULL) {
+            fprintf(stderr, "Failed to open %s for write\n", outfile_name);
+            exit(1);
+        }
+    }
+
+    randstate_init(seed);
+
+    if (json_output) {
+        fprintf(oFile, "[");
+    } else {
+        fprintf(oFile, "benchmark,bits,bytes,reps,ns_total,ns_per_op,check\n");
+    }
+
+    mpz_t p, q, n, e, d;
+    mpz_inits(p, q, n, e, d, NULL);
+
+    for (size_t b = 0; b < NUM_MODULI && modulus_bits[b] <= max_bits; b++) {
+        uint64_t bits = modulus_bits[b];
+        make_key(p, q, n, e, d, bits);
+
+        bench_pow_mod(oFile, n, bits, reps);
+        bench_pow_mod_window(oFile, n, bits, reps);
+        bench_pow_mod_ui(oFile, n, bits, reps);
+        bench_batch_decrypt(oFile, p, q, n, bits, reps);
+        bench_gcd(oFile, bits, reps);
+        bench_mod_inverse(oFile, n, bits, reps);
+        bench_is_prime(oFile, p, n, 50, reps);
+
+        if (bits <= max_prime_bits) {
+            bench_make_prime(oFile, bits / 2, 50, reps);
+        }
+
+        for (size_t s = 0; s < NUM_SIZES && file_sizes[s] <= max_size; s++) {
+            bench_file(oFile, p, q, n, e, d, bits, file_sizes[s]);
+        }
+    }
+
+    if (json_output) {
+        fprintf(oFile, "\n]\n");
+    }
+
+    mpz_clears(p, q, n, e, d, NULL);
+    randstate_clear();
+
+    if (oFile != stdout) {
+        fclose(oFile);
+    }
+
+    return all_passed ? 0 : 1;
+}
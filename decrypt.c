@@ -1,30 +1,47 @@
 #include "rsa.h"
 #include "randstate.h"
 #include "numtheory.h"
+#include "keyctx.h"
+#include "batch.h"
+#include "stats.h"
+#include "tune.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 #include <gmp.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <string.h>
 #include <stdlib.h>
 
-#define OPTIONS "hvi:o:n:"
+#define OPTIONS "hvmi:o:n:c:"
+
+// Long options: the shared instrumentation options, then the autotuner
+
+static struct option long_options[] = {
+    STATS_LONG_OPTIONS,
+    TUNE_LONG_OPTION,
+    { NULL, 0, NULL, 0 },
+};
 
 int main(int argc, char **argv) {
     int opt = 0;
     bool print_usage = false, print_verbose = false;
-    char *infile_name = NULL, *outfile_name = NULL, *priv_keyfile = "rsa.priv";
+    bool use_batch = false;
+    char *infile_name = NULL, *outfile_name = NULL, *priv_keyfile = "rsa.priv", *ctx_name = NULL;
     FILE *iFile = stdin, *oFile = stdout, *pvfile = NULL;
 
     // Parsing command-line options
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': print_usage = true; break;
         case 'v': print_verbose = true; break;
         case 'i': infile_name = optarg; break;
         case 'o': outfile_name = optarg; break;
         case 'n': priv_keyfile = optarg; break;
-        default: print_usage = true; break;
+        case 'c': ctx_name = optarg; break;
+        case 'm': use_batch = true; break;
+        default: print_usage = !stats_parse_option(opt, optarg) && !tune_parse_option(opt); break;
         }
     }
 
@@ -34,17 +51,38 @@ int main(int argc, char **argv) {
         printf("   Decrypts data using RSA encryption.\n");
         printf("   Encrypted data is encrypted by the encrypt program.\n\n");
         printf("USAGE\n");
-        printf("   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n\n");
+        printf("   ./decrypt [-hvm] [-i infile] [-o outfile] [-c pvctx] -n privkey\n\n");
         printf("OPTIONS\n");
         printf("   -h              Display program help and usage.\n");
         printf("   -v              Display verbose program output.\n");
         printf("   -i infile       Input file of data to encrypt (default: stdin).\n");
         printf("   -o outfile      Output file for encrypted data (default: stdout).\n");
         printf("   -n pvfile       Private key file (default: rsa.priv).\n");
+        printf("   -c pvctx        Compiled private key context, decrypts with CRT.\n");
+        printf("   -m              The private key is a batch key made by keygen -m.\n");
+        printf(STATS_USAGE);
+        printf(TUNE_USAGE);
+    }
+
+    // Collection stays off unless -v or --stats is given
+    uint64_t run_start = stats_begin(print_verbose, print_usage);
+
+    // Maps the compiled key context if one was given
+    keyctx ctx;
+    bool use_ctx = ctx_name != NULL;
+
+    if (use_ctx && use_batch) {
+        fprintf(stderr, "A batch key can't be read from a key context.\n");
+        exit(1);
+    }
+
+    if (use_ctx && !keyctx_load(&ctx, ctx_name, KEYCTX_PRIV)) {
+        fprintf(stderr, "Unable to load private key context.\n");
+        exit(1);
     }
 
     // Opens private key file
-    if (priv_keyfile != NULL) {
+    if (priv_keyfile != NULL && !use_ctx) {
         pvfile = fopen(priv_keyfile, "r");
 
         if (pvfile == NULL) {
@@ -71,7 +109,27 @@ int main(int argc, char **argv) {
     // Reading from private key file
     mpz_t n, d;
     mpz_inits(n, d, NULL);
-    rsa_read_priv(n, d, pvfile);
+    batch_key batch;
+    batch_key_init(&batch);
+
+    if (use_ctx) {
+        mpz_set(n, ctx.n);
+        mpz_set(d, ctx.d);
+    } else if (use_batch) {
+        if (!batch_read_priv(&batch, pvfile)) {
+            fprintf(stderr, "Malformed batch private key.\n");
+            exit(1);
+        }
+
+        mpz_set(n, batch.n);
+    } else {
+        rsa_read_priv(n, d, pvfile);
+    }
+
+    // Picks the kernel, threads and batch width for this modulus size
+    // CRT exponentiations work mod p and q, so a context or batch key tunes for half the bits
+    size_t bits = mpz_sizeinbase(n, 2);
+    tune_begin(use_ctx || use_batch ? bits / 2 : bits, print_verbose, print_usage);
 
     // Print verbose command-line option
     if (print_verbose && !print_usage) {
@@ -79,12 +137,37 @@ int main(int argc, char **argv) {
         gmp_printf("d (%zu bits) = %Zu\n", mpz_sizeinbase(d, 2), d);
     }
 
-    // Decrypts the file
-    rsa_decrypt_file(iFile, oFile, n, d);
+    // Decrypts the file, with the precomputed CRT values when a context is loaded
+    // A batch key decrypts one group of blocks per full-size exponentiation
+    bool decrypted = true;
+
+    if (use_batch) {
+        if (!batch_decrypt_file(iFile, oFile, &batch)) {
+            fprintf(stderr, "Malformed batch ciphertext.\n");
+            exit(1);
+        }
+    } else if (use_ctx) {
+        decrypted
+            = rsa_decrypt_file_crt(iFile, oFile, ctx.n, ctx.p, ctx.q, ctx.dp, ctx.dq, ctx.qinv);
+    } else {
+        decrypted = rsa_decrypt_file(iFile, oFile, n, d);
+    }
+
+    if (!decrypted) {
+        fprintf(stderr, "Out of memory for the block batch.\n");
+        exit(1);
+    }
+
+    stats_end(run_start);
 
     // Close the iFile and oFile
     // Clear memory in mpz variables
     mpz_clears(n, d, NULL);
+    batch_key_clear(&batch);
+
+    if (use_ctx) {
+        keyctx_clear(&ctx);
+    }
 
     if (iFile != NULL) {
         fclose(iFile);
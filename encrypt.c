@@ -1,30 +1,49 @@
 #include "numtheory.h"
+#include "stats.h"
+#include "tune.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "keyctx.h"
+#include "batch.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <string.h>
 #include <stdbool.h>
 #include <gmp.h>
 
-#define OPTIONS "hvn:i:o:"
+#define OPTIONS "hvmn:i:o:c:u:"
+
+// Long options: the shared instrumentation options, then the autotuner
+
+static struct option long_options[] = {
+    STATS_LONG_OPTIONS,
+    TUNE_LONG_OPTION,
+    { NULL, 0, NULL, 0 },
+};
 
 int main(int argc, char **argv) {
     int opt = 0;
     bool print_usage = false, print_verbose = false;
-    char *infile_name = NULL, *outfile_name = NULL, *pb_keyfile = "rsa.pub";
+    bool use_batch = false;
+    char *infile_name = NULL, *outfile_name = NULL, *pb_keyfile = "rsa.pub", *ctx_name = NULL;
+    char *index_name = NULL;
     FILE *iFile = stdin, *oFile = stdout, *pbfile = NULL;
 
     // Parsing command-line options
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': print_usage = true; break;
         case 'v': print_verbose = true; break;
         case 'i': infile_name = optarg; break;
         case 'o': outfile_name = optarg; break;
         case 'n': pb_keyfile = optarg; break;
-        default: print_usage = true; break;
+        case 'c': ctx_name = optarg; break;
+        case 'u': index_name = optarg; break;
+        case 'm': use_batch = true; break;
+        default: print_usage = !stats_parse_option(opt, optarg) && !tune_parse_option(opt); break;
         }
     }
 
@@ -35,17 +54,40 @@ int main(int argc, char **argv) {
         printf("   Encrypts data using RSA encryption.\n");
         printf("   Encrypted data is decrypted by the decrypt program.\n\n");
         printf("USAGE\n");
-        printf("   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n\n");
+        printf("   ./encrypt [-hvm] [-i infile] [-o outfile] [-c pbctx] [-u index] -n pubkey\n\n");
         printf("OPTIONS\n");
         printf("   -h              Display program help and usage.\n");
         printf("   -v              Display verbose program output.\n");
         printf("   -i infile       Input file of data to encrypt (default: stdin).\n");
         printf("   -o outfile      Output file for encrypted data (default: stdout).\n");
         printf("   -n pbfile       Public key file (default: rsa.pub).\n");
+        printf("   -c pbctx        Compiled public key context, used instead of -n.\n");
+        printf("   -u index        Block hash index; only blocks edited in place are redone.\n");
+        printf("   -m              The public key is a batch key made by keygen -m.\n");
+        printf(STATS_USAGE);
+        printf(TUNE_USAGE);
+    }
+
+    // Collection stays off unless -v or --stats is given
+    uint64_t run_start = stats_begin(print_verbose, print_usage);
+
+    // Maps the compiled key context if one was given
+    keyctx ctx;
+    bool use_ctx = ctx_name != NULL;
+
+    // Batch keys have their own file format and rotate exponents, so they can't be indexed
+    if (use_batch && (use_ctx || index_name != NULL)) {
+        fprintf(stderr, "A batch key can't be used with -c or -u.\n");
+        exit(1);
+    }
+
+    if (use_ctx && !keyctx_load(&ctx, ctx_name, KEYCTX_PUB)) {
+        fprintf(stderr, "Unable to load public key context.\n");
+        exit(1);
     }
 
     // Opens the public key file
-    if (pb_keyfile != NULL) {
+    if (pb_keyfile != NULL && !use_ctx) {
         pbfile = fopen(pb_keyfile, "r");
 
         if (pbfile == NULL) {
@@ -65,15 +107,59 @@ int main(int argc, char **argv) {
     }
 
     // Writes encrypted message to output file
-    if (outfile_name != NULL) {
+    // Incremental runs write next to the old ciphertext and index, then replace them at the end
+    char out_tmp[4096], index_tmp[4096];
+    FILE *oldFile = NULL, *oldIndex = NULL, *newIndex = NULL;
+
+    if (index_name != NULL) {
+        if (outfile_name == NULL) {
+            fprintf(stderr, "Incremental encryption needs an outfile.\n");
+            exit(1);
+        }
+
+        snprintf(out_tmp, sizeof(out_tmp), "%s.tmp", outfile_name);
+        snprintf(index_tmp, sizeof(index_tmp), "%s.tmp", index_name);
+        oldFile = fopen(outfile_name, "r");
+        oldIndex = fopen(index_name, "r");
+        oFile = fopen(out_tmp, "w");
+        newIndex = fopen(index_tmp, "w");
+
+        if (oFile == NULL || newIndex == NULL) {
+            fprintf(stderr, "Unable to open outfile.\n");
+            exit(1);
+        }
+    } else if (outfile_name != NULL) {
         oFile = fopen(outfile_name, "w");
     }
 
-    // Reading from the public key file
+    // Reading from the public key file, or copying the limbs out of the context
     mpz_t n, e, s;
     char *username = getenv("USER");
     mpz_inits(n, e, s, NULL);
-    rsa_read_pub(n, e, s, username, pbfile);
+    batch_key batch;
+    batch_key_init(&batch);
+
+    if (use_ctx) {
+        mpz_set(n, ctx.n);
+        mpz_set(e, ctx.e);
+        mpz_set(s, ctx.s);
+        username = ctx.username;
+    } else if (use_batch) {
+        // The username is signed under the product of the exponents
+        if (!batch_read_pub(&batch, s, username, pbfile)) {
+            fprintf(stderr, "Malformed batch public key.\n");
+            exit(1);
+        }
+
+        mpz_set(n, batch.n);
+        batch_product(e, &batch, batch.count);
+    } else {
+        rsa_read_pub(n, e, s, username, pbfile);
+    }
+
+    // Picks the kernel, threads and batch width for this modulus size
+    // The profile is tuned once per CPU and size, then read from the cache
+    tune_begin(mpz_sizeinbase(n, 2), print_verbose, print_usage);
 
     // Verbose option check...
     if (print_verbose && !print_usage) {
@@ -90,17 +176,41 @@ int main(int argc, char **argv) {
     mpz_set_str(m, username, 62);
 
     // If the sigature wasn't verified, it will throw an error
-    if (!rsa_verify(m, s, e, n)) {
+    // A context that keygen already verified skips the check
+    if (!(use_ctx && ctx.verified) && !rsa_verify(m, s, e, n)) {
         fprintf(stderr, "Signature couldn't be verified.\n");
         exit(1);
     }
 
     // Call to rsa encrypt file
-    rsa_encrypt_file(iFile, oFile, n, e);
+    if (use_batch) {
+        if (!batch_encrypt_file(iFile, oFile, &batch)) {
+            fprintf(stderr, "Unable to pad blocks: the key is too small or /dev/urandom is "
+                            "unavailable.\n");
+            exit(1);
+        }
+    } else if (index_name != NULL) {
+        if (!rsa_encrypt_file_incremental(iFile, oFile, oldFile, oldIndex, newIndex, n, e)) {
+            fprintf(stderr, "Out of memory for the block index.\n");
+            exit(1);
+        }
+    } else {
+        if (!rsa_encrypt_file(iFile, oFile, n, e)) {
+            fprintf(stderr, "Out of memory for the block batch.\n");
+            exit(1);
+        }
+    }
+
+    stats_end(run_start);
 
     // Closing the pbfile, iFile and oFile
     // Clears memory from mpz variables
     mpz_clears(m, n, e, s, NULL);
+    batch_key_clear(&batch);
+
+    if (use_ctx) {
+        keyctx_clear(&ctx);
+    }
 
     if (pbfile != NULL) {
         fclose(pbfile);
@@ -113,4 +223,22 @@ int main(int argc, char **argv) {
     if (oFile != NULL) {
         fclose(oFile);
     }
+
+    // Replaces the old ciphertext and index with the new ones
+    if (index_name != NULL) {
+        if (oldFile != NULL) {
+            fclose(oldFile);
+        }
+
+        if (oldIndex != NULL) {
+            fclose(oldIndex);
+        }
+
+        fclose(newIndex);
+
+        if (rename(out_tmp, outfile_name) != 0 || rename(index_tmp, index_name) != 0) {
+            fprintf(stderr, "Unable to replace outfile.\n");
+            exit(1);
+        }
+    }
 }
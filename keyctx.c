@@ -0,0 +1,250 @@
+#include "keyctx.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gmp.h>
+
+// Compiled key file layout:
+//   header | field table | limbs of each field, native mp_limb_t order
+// Everything stays 8 byte aligned so limbs can be used in place from the mapping
+#define KEYCTX_MAGIC      "RSAKCTX"
+#define KEYCTX_VERSION    1
+#define KEYCTX_BYTE_ORDER 0x01020304u
+#define KEYCTX_VERIFIED   0x1u
+
+enum {
+    FIELD_N,
+    FIELD_E,
+    FIELD_S,
+    FIELD_D,
+    FIELD_P,
+    FIELD_Q,
+    FIELD_DP,
+    FIELD_DQ,
+    FIELD_QINV,
+    NUM_FIELDS
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t flags;
+    uint32_t num_fields;
+    uint32_t limb_bytes;
+    uint32_t byte_order;
+    uint64_t checksum;
+    char username[KEYCTX_USER_MAX];
+} ctx_header;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t limbs;
+    uint64_t offset;
+} ctx_field;
+
+// FNV-1a over the whole file, skipping the checksum slot itself
+static uint64_t ctx_checksum(const uint8_t *buf, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t skip = offsetof(ctx_header, checksum);
+
+    for (size_t i = 0; i < len; i++) {
+        if (i >= skip && i < skip + sizeof(uint64_t)) {
+            continue;
+        }
+
+        hash ^= buf[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Serializes the given fields into one buffer and writes it out in a single call
+static bool ctx_write(FILE *ctxfile, keyctx_kind kind, uint32_t flags, char username[],
+    const uint32_t tags[], mpz_ptr values[], uint32_t count) {
+    size_t len = sizeof(ctx_header) + count * sizeof(ctx_field);
+
+    for (uint32_t i = 0; i < count; i++) {
+        len += mpz_size(values[i]) * sizeof(mp_limb_t);
+    }
+
+    uint8_t *buf = (uint8_t *) calloc(len, sizeof(uint8_t));
+
+    if (buf == NULL) {
+        return false;
+    }
+
+    ctx_header *header = (ctx_header *) buf;
+    ctx_field *fields = (ctx_field *) (buf + sizeof(ctx_header));
+    size_t offset = sizeof(ctx_header) + count * sizeof(ctx_field);
+
+    memcpy(header->magic, KEYCTX_MAGIC, sizeof(KEYCTX_MAGIC));
+    header->version = KEYCTX_VERSION;
+    header->kind = kind;
+    header->flags = flags;
+    header->num_fields = count;
+    header->limb_bytes = sizeof(mp_limb_t);
+    header->byte_order = KEYCTX_BYTE_ORDER;
+
+    if (username != NULL) {
+        strncpy(header->username, username, KEYCTX_USER_MAX - 1);
+    }
+
+    // Copies the limbs of each value in place after the field table
+    for (uint32_t i = 0; i < count; i++) {
+        size_t limbs = mpz_size(values[i]);
+        fields[i].tag = tags[i];
+        fields[i].limbs = limbs;
+        fields[i].offset = offset;
+        memcpy(buf + offset, mpz_limbs_read(values[i]), limbs * sizeof(mp_limb_t));
+        offset += limbs * sizeof(mp_limb_t);
+    }
+
+    header->checksum = ctx_checksum(buf, len);
+    bool written = fwrite(buf, sizeof(uint8_t), len, ctxfile) == len;
+    free(buf);
+    return written;
+}
+
+// Writes a public key context, recording whether the username signature verified
+bool keyctx_write_pub(FILE *ctxfile, mpz_t n, mpz_t e, mpz_t s, char username[], bool verified) {
+    uint64_t start = stats_start();
+    const uint32_t tags[] = { FIELD_N, FIELD_E, FIELD_S };
+    mpz_ptr values[] = { n, e, s };
+
+    bool written
+        = ctx_write(ctxfile, KEYCTX_PUB, verified ? KEYCTX_VERIFIED : 0, username, tags, values, 3);
+    stats_stop(STAT_TIME_KEY_IO, start);
+    return written;
+}
+
+// Writes a private key context along with the CRT exponents and coefficient
+bool keyctx_write_priv(FILE *ctxfile, mpz_t n, mpz_t d, mpz_t p, mpz_t q) {
+    uint64_t start = stats_start();
+    mpz_t dp, dq, qinv, tmp;
+    mpz_inits(dp, dq, qinv, tmp, NULL);
+
+    // dp = d mod (p - 1), dq = d mod (q - 1), qinv = q^-1 mod p
+    mpz_sub_ui(tmp, p, 1);
+    mpz_mod(dp, d, tmp);
+    mpz_sub_ui(tmp, q, 1);
+    mpz_mod(dq, d, tmp);
+    mod_inverse(qinv, q, p);
+
+    const uint32_t tags[] = { FIELD_N, FIELD_D, FIELD_P, FIELD_Q, FIELD_DP, FIELD_DQ, FIELD_QINV };
+    mpz_ptr values[] = { n, d, p, q, dp, dq, qinv };
+
+    bool written = ctx_write(ctxfile, KEYCTX_PRIV, 0, NULL, tags, values, 7);
+    mpz_clears(dp, dq, qinv, tmp, NULL);
+    stats_stop(STAT_TIME_KEY_IO, start);
+    return written;
+}
+
+// Checks the header, checksum and field table of a mapped file
+// Points each mpz at its limbs inside the mapping on success
+static bool ctx_bind(keyctx *ctx, const uint8_t *buf, size_t len, keyctx_kind kind) {
+    static const mp_limb_t zero = 0;
+    mpz_ptr slots[NUM_FIELDS]
+        = { ctx->n, ctx->e, ctx->s, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv };
+    const ctx_header *header = (const ctx_header *) buf;
+
+    if (len < sizeof(ctx_header) || memcmp(header->magic, KEYCTX_MAGIC, sizeof(KEYCTX_MAGIC)) != 0
+        || header->version != KEYCTX_VERSION || header->kind != (uint32_t) kind
+        || header->limb_bytes != sizeof(mp_limb_t) || header->byte_order != KEYCTX_BYTE_ORDER
+        || header->num_fields > NUM_FIELDS
+        || len < sizeof(ctx_header) + header->num_fields * sizeof(ctx_field)
+        || header->checksum != ctx_checksum(buf, len)) {
+        return false;
+    }
+
+    for (int i = 0; i < NUM_FIELDS; i++) {
+        mpz_roinit_n(slots[i], &zero, 0);
+    }
+
+    const ctx_field *fields = (const ctx_field *) (buf + sizeof(ctx_header));
+    uint32_t seen = 0;
+
+    for (uint32_t i = 0; i < header->num_fields; i++) {
+        const ctx_field *f = &fields[i];
+
+        if (f->tag >= NUM_FIELDS || f->offset % sizeof(mp_limb_t) != 0 || f->offset > len
+            || f->limbs > (len - f->offset) / sizeof(mp_limb_t)) {
+            return false;
+        }
+
+        mpz_roinit_n(slots[f->tag], (const mp_limb_t *) (buf + f->offset), f->limbs);
+        seen |= 1u << f->tag;
+    }
+
+    uint32_t needed = kind == KEYCTX_PUB
+                          ? (1u << FIELD_N) | (1u << FIELD_E) | (1u << FIELD_S)
+                          : (1u << FIELD_N) | (1u << FIELD_D) | (1u << FIELD_P) | (1u << FIELD_Q)
+                                | (1u << FIELD_DP) | (1u << FIELD_DQ) | (1u << FIELD_QINV);
+
+    if ((seen & needed) != needed) {
+        return false;
+    }
+
+    ctx->kind = kind;
+    ctx->verified = (header->flags & KEYCTX_VERIFIED) != 0;
+    memcpy(ctx->username, header->username, KEYCTX_USER_MAX);
+    ctx->username[KEYCTX_USER_MAX - 1] = '\0';
+    return true;
+}
+
+// Maps a compiled key file read-only, returning false if it is missing or corrupt
+bool keyctx_load(keyctx *ctx, const char *path, keyctx_kind kind) {
+    uint64_t start = stats_start();
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    memset(ctx, 0, sizeof(*ctx));
+
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    ctx->map = map;
+    ctx->map_len = st.st_size;
+
+    if (!ctx_bind(ctx, (const uint8_t *) map, ctx->map_len, kind)) {
+        keyctx_clear(ctx);
+        return false;
+    }
+
+    stats_stop(STAT_TIME_KEY_IO, start);
+    return true;
+}
+
+// Unmaps the key file; the mpz views become invalid afterwards
+void keyctx_clear(keyctx *ctx) {
+    if (ctx->map != NULL) {
+        munmap(ctx->map, ctx->map_len);
+    }
+
+    ctx->map = NULL;
+    ctx->map_len = 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#define KEYCTX_USER_MAX 64
+
+typedef enum { KEYCTX_PUB = 1, KEYCTX_PRIV = 2 } keyctx_kind;
+
+// A key context loaded from a compiled key file
+// The mpz fields are read-only views into the mapped file and must not be modified or cleared
+typedef struct {
+    keyctx_kind kind;
+    bool verified;
+    char username[KEYCTX_USER_MAX];
+    mpz_t n, e, s;
+    mpz_t d, p, q, dp, dq, qinv;
+    void *map;
+    size_t map_len;
+} keyctx;
+
+bool keyctx_write_pub(FILE *ctxfile, mpz_t n, mpz_t e, mpz_t s, char username[], bool verified);
+
+bool keyctx_write_priv(FILE *ctxfile, mpz_t n, mpz_t d, mpz_t p, mpz_t q);
+
+bool keyctx_load(keyctx *ctx, const char *path, keyctx_kind kind);
+
+void keyctx_clear(keyctx *ctx);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
@@ -12,28 +13,44 @@
 #include "rsa.h"
 #include "randstate.h"
 #include "numtheory.h"
+#include "stats.h"
+#include "tune.h"
+#include "keyctx.h"
+#include "batch.h"
 #include "sys/stat.h"
 
-gmp_randstate_t state;
+#define OPTIONS "hvcb:i:n:d:s:e:m:"
 
-#define OPTIONS "hvb:i:n:d:s:"
+// Long options: the shared instrumentation options, then the autotuner
+
+static struct option long_options[] = {
+    STATS_LONG_OPTIONS,
+    TUNE_LONG_OPTION,
+    { NULL, 0, NULL, 0 },
+};
 
 int main(int argc, char **argv) {
     int opt = 0;
     bool print_usage = false, print_verbose = false;
+    bool emit_ctx = false;
     uint32_t min_bits = 256, num_iters = 50, random_seed = time(NULL);
+    uint64_t fixed_e = 0;
+    uint32_t batch_exps = 0;
     char *pbfile = "rsa.pub", *pvfile = "rsa.priv";
 
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'h': print_usage = true; break;
         case 'v': print_verbose = true; break;
+        case 'c': emit_ctx = true; break;
         case 'b': min_bits = atoi(optarg); break;
         case 'i': num_iters = atoi(optarg); break;
         case 's': random_seed = atoi(optarg); break;
+        case 'e': fixed_e = strtoull(optarg, NULL, 10); break;
+        case 'm': batch_exps = atoi(optarg); break;
         case 'n': pbfile = optarg; break;
         case 'd': pvfile = optarg; break;
-        default: print_usage = true; break;
+        default: print_usage = !stats_parse_option(opt, optarg) && !tune_parse_option(opt); break;
         }
     }
 
@@ -42,15 +59,39 @@ int main(int argc, char **argv) {
         printf("SYNOPSIS\n");
         printf("   Generates an RSA public/private key pair.\n\n");
         printf("USAGE\n");
-        printf("   ./keygen [-hv] [-b bits] -n pbfile -d pvfile\n\n");
+        printf("   ./keygen [-hvc] [-b bits] [-m count] -n pbfile -d pvfile\n\n");
         printf("OPTIONS\n");
         printf("   -h              Display program help and usage.\n");
         printf("   -v              Display verbose program output.\n");
+        printf("   -c              Also write compiled key contexts to pbfile.ctx and pvfile.ctx.\n");
         printf("   -b bits         Minimum bits needed for public key n (default: 256).\n");
         printf("   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n");
         printf("   -n pbfile       Public key file (default: rsa.pub).\n");
         printf("   -d pvfile       Private key file (default: rsa.priv).\n");
         printf("   -s seed         Random seed for testing.\n");
+        printf("   -e exponent     Fixed odd public exponent, at least 65537 (default: random).\n");
+        printf("   -m count        Batch key: one modulus with count small coprime exponents.\n");
+        printf(STATS_USAGE);
+        printf(TUNE_USAGE);
+    }
+
+    // Collection stays off unless -v or --stats is given
+    uint64_t run_start = stats_begin(print_verbose, print_usage);
+
+    // A fixed exponent must be odd to be invertible mod lambda(n)
+    // Blocks aren't padded, so a short block under a tiny exponent such as 3 can be
+    // recovered with an integer root; 65537 keeps m^e far above n for any nonempty block
+    if (fixed_e != 0 && (fixed_e < 65537 || fixed_e % 2 == 0)) {
+        fprintf(stderr, "Public exponent must be odd and at least 65537\n");
+        exit(1);
+    }
+
+    // A batch key has its own key file format, so it can't use -e or compiled contexts
+    if (batch_exps != 0
+        && (batch_exps < 2 || batch_exps > BATCH_MAX_EXPS || fixed_e != 0 || emit_ctx)) {
+        fprintf(stderr, "Batch keys need 2 to %d exponents and can't use -e or -c\n",
+            BATCH_MAX_EXPS);
+        exit(1);
     }
 
     FILE *pubFile = NULL, *privFile = NULL;
@@ -84,10 +125,34 @@ int main(int argc, char **argv) {
     // Randomly initializes random seed
     randstate_init(random_seed);
 
+    // Prime testing works on numbers of about half the modulus size
+    // The profile is tuned once per CPU and size, then read from the cache
+    tune_begin(min_bits / 2, print_verbose, print_usage);
+
     // Generating the key
     mpz_t p, q, n, e;
     mpz_inits(p, q, n, e, NULL);
-    rsa_make_pub(p, q, n, e, min_bits, num_iters);
+
+    // Uses the fixed exponent if one was requested
+    if (fixed_e != 0) {
+        mpz_set_ui(e, fixed_e);
+        rsa_make_pub_exp(p, q, n, e, min_bits, num_iters);
+    } else {
+        rsa_make_pub(p, q, n, e, min_bits, num_iters);
+    }
+
+    // A batch key picks its exponents after the primes, skipping any that divide p - 1 or q - 1
+    // e becomes their product, so the username signature below covers all of them
+    batch_key batch;
+    batch_key_init(&batch);
+
+    if (batch_exps != 0) {
+        mpz_set(batch.n, n);
+        mpz_set(batch.p, p);
+        mpz_set(batch.q, q);
+        batch_make_exps(&batch, batch_exps);
+        batch_product(e, &batch, batch.count);
+    }
 
     // Make the private key
     mpz_t d;
@@ -107,11 +172,39 @@ int main(int argc, char **argv) {
     mpz_set_str(m, username, 62);
     rsa_sign(s, m, d, n);
 
-    // Writes out public key
-    rsa_write_pub(n, e, s, username, pubFile);
+    // Writes out public and private key
+    if (batch_exps != 0) {
+        batch_write_pub(&batch, s, username, pubFile);
+        batch_write_priv(&batch, privFile);
+    } else {
+        rsa_write_pub(n, e, s, username, pubFile);
+        rsa_write_priv(n, d, privFile);
+    }
+
+    // Writes compiled contexts next to the text keys
+    // The public context records that the signature verified so encrypt can skip the check
+    if (emit_ctx && !print_usage) {
+        char pbctx[4096], pvctx[4096];
+        snprintf(pbctx, sizeof(pbctx), "%s.ctx", pbfile);
+        snprintf(pvctx, sizeof(pvctx), "%s.ctx", pvfile);
+        FILE *pubCtx = fopen(pbctx, "w"), *privCtx = fopen(pvctx, "w");
 
-    // Writes out private key
-    rsa_write_priv(n, d, privFile);
+        if (pubCtx == NULL || privCtx == NULL) {
+            fprintf(stderr, "Failed to open %s for write\n", pubCtx == NULL ? pbctx : pvctx);
+            exit(1);
+        }
+
+        fchmod(fileno(privCtx), S_IRUSR | S_IWUSR);
+
+        if (!keyctx_write_pub(pubCtx, n, e, s, username, rsa_verify(m, s, e, n))
+            || !keyctx_write_priv(privCtx, n, d, p, q)) {
+            fprintf(stderr, "Failed to write key contexts\n");
+            exit(1);
+        }
+
+        fclose(pubCtx);
+        fclose(privCtx);
+    }
 
     // Checks if verbose was enabled to not
     // Prints out essential components which include the signature and both primes
@@ -124,10 +217,17 @@ int main(int argc, char **argv) {
         gmp_printf("n (%zu bits) = %Zu\n", mpz_sizeinbase(n, 2), n);
         gmp_printf("e (%zu bits) = %Zu\n", mpz_sizeinbase(e, 2), e);
         gmp_printf("d (%zu bits) = %Zu\n", mpz_sizeinbase(d, 2), d);
+
+        for (uint32_t i = 0; i < batch.count; i++) {
+            gmp_printf("e%u = %lu\n", i, (unsigned long) batch.exps[i]);
+        }
     }
 
+    stats_end(run_start);
+
     // Closes public and private files and clears random state
     mpz_clears(p, q, n, e, s, m, d, NULL);
+    batch_key_clear(&batch);
 
     if (pubFile != NULL) {
         fclose(pubFile);
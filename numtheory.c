@@ -1,6 +1,8 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
+#include "tune.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -29,7 +31,7 @@ void gcd(mpz_t d, mpz_t a, mpz_t b) {
 
 // Inspired by Professor Long
 // Used assignment pdf pseudocode
-void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+static void pow_mod_binary(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
     mpz_t v, p, temp_mul, temp_d, temp_p, two_val;
     mpz_inits(v, p, temp_mul, temp_d, temp_p, two_val, NULL);
     mpz_set_ui(two_val, 2);
@@ -63,6 +65,106 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
     mpz_clears(v, p, temp_mul, temp_d, temp_p, two_val, NULL);
 }
 
+// Fixed-window exponentiation: d is scanned left to right w bits at a time
+// Costs one squaring per bit plus one multiply per non-zero window, with a table of 2^w powers
+void pow_mod_window(mpz_t o, mpz_t a, mpz_t d, mpz_t n, uint32_t w) {
+    size_t size = (size_t) 1 << w;
+    mpz_t *table = (mpz_t *) malloc(size * sizeof(mpz_t));
+    mpz_t v;
+    mpz_init_set_ui(v, 1);
+
+    // table[i] = a^i mod n
+    mpz_init_set_ui(table[0], 1);
+    mpz_init(table[1]);
+    mpz_mod(table[1], a, n);
+
+    for (size_t i = 2; i < size; i++) {
+        mpz_init(table[i]);
+        mpz_mul(table[i], table[i - 1], table[1]);
+        mpz_mod(table[i], table[i], n);
+    }
+
+    // Matches pow_mod_binary: a base of 0 mod n gives 0 even for d = 0
+    if (mpz_cmp_ui(table[1], 0) == 0) {
+        mpz_set_ui(v, 0);
+    } else if (mpz_cmp_ui(d, 0) > 0) {
+        size_t bits = mpz_sizeinbase(d, 2);
+        size_t top = (bits + w - 1) / w * w;
+
+        for (size_t pos = top; pos > 0; pos -= w) {
+            unsigned long digit = 0;
+
+            for (uint32_t b = 0; b < w; b++) {
+                mpz_mul(v, v, v);
+                mpz_mod(v, v, n);
+                digit = (digit << 1) | (unsigned long) mpz_tstbit(d, pos - 1 - b);
+            }
+
+            if (digit != 0) {
+                mpz_mul(v, v, table[digit]);
+                mpz_mod(v, v, n);
+            }
+        }
+    }
+
+    mpz_mod(o, v, n);
+
+    for (size_t i = 0; i < size; i++) {
+        mpz_clear(table[i]);
+    }
+
+    free(table);
+    mpz_clear(v);
+}
+
+// Computes o = a^d mod n with the kernel chosen by the autotuner
+// Untuned runs use the binary square-and-multiply kernel
+void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    uint64_t start = stats_start();
+    stats_count(STAT_MODEXP, 1);
+
+    switch (tune_active.kernel) {
+    case TUNE_KERNEL_WINDOW: pow_mod_window(o, a, d, n, tune_active.window); break;
+    case TUNE_KERNEL_GMP: mpz_powm(o, a, d, n); break;
+    default: pow_mod_binary(o, a, d, n); break;
+    }
+
+    stats_stop(STAT_TIME_MODEXP, start);
+}
+
+// Short exponent fast path for public-key operations such as e = 65537
+// Scans e left to right, so the work is one squaring per bit plus one multiply per set bit
+void pow_mod_ui(mpz_t o, mpz_t a, unsigned long e, mpz_t n) {
+    uint64_t start = stats_start();
+    stats_count(STAT_MODEXP, 1);
+
+    mpz_t base, v;
+    mpz_inits(base, v, NULL);
+    mpz_mod(base, a, n);
+    mpz_set_ui(v, 1);
+
+    // Finds the highest set bit so no squarings are spent on leading zeros
+    int top = (int) (sizeof(unsigned long) * 8) - 1;
+
+    while (top >= 0 && ((e >> top) & 1UL) == 0) {
+        top--;
+    }
+
+    for (int bit = top; bit >= 0; bit--) {
+        mpz_mul(v, v, v);
+        mpz_mod(v, v, n);
+
+        if ((e >> bit) & 1UL) {
+            mpz_mul(v, v, base);
+            mpz_mod(v, v, n);
+        }
+    }
+
+    mpz_mod(o, v, n);
+    mpz_clears(base, v, NULL);
+    stats_stop(STAT_TIME_MODEXP, start);
+}
+
 // Inspired by Professor Long
 // Used assignment pseudocode
 // Also used various GMP library functions
@@ -95,16 +197,10 @@ bool is_prime(mpz_t n, uint64_t iters) {
     mpz_set_ui(mpz_two, 2);
     mpz_sub_ui(n_minus_3, n, 3);
 
-    time_t tim;
-    srand((unsigned) time(&tim));
-    uint64_t random_seed = 0;
-    gmp_randstate_t tmp_state;
-    gmp_randinit_mt(tmp_state);
-
+    // Witnesses are drawn from the global random state so runs are reproducible
     for (uint64_t i = 1; i < iters; i++) {
-        random_seed = rand() + 1;
-        gmp_randseed_ui(tmp_state, random_seed);
-        mpz_urandomm(random_mpz, tmp_state, n_minus_3);
+        stats_count(STAT_MR_ROUNDS, 1);
+        mpz_urandomm(random_mpz, state, n_minus_3);
         mpz_add(random_mpz, random_mpz, mpz_two);
         pow_mod(y, random_mpz, r, n);
 
@@ -131,30 +227,31 @@ bool is_prime(mpz_t n, uint64_t iters) {
 
     // Frees all memory
     mpz_clears(r, s, y, n_minus_1, mpz_two, random_mpz, n_minus_3, NULL);
-    gmp_randclear(tmp_state);
     return true;
 }
 
 // Inspired by TA Eric
 // Generates prime numbers from is_prime
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
+    uint64_t start = stats_start();
+    bool prime = false;
     mpz_t tmp_p;
     mpz_init(tmp_p);
 
-    srand((unsigned) time(NULL));
-    uint64_t random_seed = rand() + 1;
-    gmp_randstate_t tmp_state;
-    gmp_randinit_mt(tmp_state);
-    gmp_randseed_ui(tmp_state, random_seed);
-
     do {
+        stats_count(STAT_PRIME_CANDIDATES, 1);
         mpz_ui_pow_ui(tmp_p, 2, bits - 1);
-        mpz_urandomm(p, tmp_state, tmp_p);
+        mpz_urandomm(p, state, tmp_p);
         mpz_add(p, p, tmp_p);
-    } while (is_prime(p, iters) == false);
+        prime = is_prime(p, iters);
+
+        if (!prime) {
+            stats_count(STAT_PRIME_REJECTED, 1);
+        }
+    } while (prime == false);
 
     mpz_clear(tmp_p);
-    gmp_randclear(tmp_state);
+    stats_stop(STAT_TIME_PRIME, start);
 }
 
 // Inspired pseudocode by Professor Long
@@ -11,6 +11,10 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
 
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
+void pow_mod_window(mpz_t o, mpz_t a, mpz_t d, mpz_t n, uint32_t w);
+
+void pow_mod_ui(mpz_t o, mpz_t a, unsigned long e, mpz_t n);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
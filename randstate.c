@@ -8,7 +8,9 @@
 
 gmp_randstate_t state;
 
+// Seeds both random() and the GMP Mersenne Twister so a seed fixes every draw
 void randstate_init(uint64_t seed) {
+    srandom(seed);
     gmp_randinit_mt(state);
     gmp_randseed_ui(state, seed);
 }
@@ -1,21 +1,27 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <gmp.h>
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include "numtheory.h"
 #include "randstate.h"
 #include "rsa.h"
+#include "sha256.h"
+#include "tune.h"
+#include "stats.h"
+
+// Bytes per index entry: a plaintext block hash and a ciphertext line hash
+#define INDEX_ENTRY (2 * SHA256_DIGEST)
 
 // Creates parts of a public key: p and q are large primes of size bits/2, n = p
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
 
     // First, split the bits for p and q
-    time_t tim;
-    srand((unsigned) time(&tim));
-    uint64_t pbits = (rand() % ((3 * nbits / 4) - (nbits / 4)) + 1) + (nbits / 4);
+    uint64_t pbits = (random() % ((3 * nbits / 4) - (nbits / 4)) + 1) + (nbits / 4);
     uint64_t qbits = nbits - pbits;
 
     // Creates p and q using make_prime
@@ -46,33 +52,55 @@ void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t i
     mpz_mul(totient, pminus1, qminus1);
     assert(mpz_sizeinbase(n, 2) == nbits);
 
-    uint64_t random_seed;
     mpz_t random_mpz, gcdout;
     mpz_inits(random_mpz, gcdout, NULL);
 
-    srand((unsigned) time(&tim));
-    random_seed = rand() + 1;
-
-    gmp_randstate_t tmp_state;
-    gmp_randinit_mt(tmp_state);
-    gmp_randseed_ui(tmp_state, random_seed);
-
     do {
-        mpz_urandomm(random_mpz, tmp_state, totient);
+        mpz_urandomm(random_mpz, state, totient);
         mpz_add_ui(random_mpz, random_mpz, 1);
         gcd(gcdout, totient, random_mpz);
         mpz_set(e, random_mpz);
     } while (mpz_cmp_ui(gcdout, 1) != 0);
 
     // Free up memory allocated in gmp types
-    gmp_randclear(tmp_state);
     mpz_clears(mul_bits, pminus1, qminus1, random_mpz, gcdout, totient, NULL);
 }
 
+// Creates a public key around a fixed exponent e, such as 65537
+// Primes are regenerated until gcd(e, lambda(n)) = 1 so that e is invertible
+void rsa_make_pub_exp(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    mpz_t pminus1, qminus1, lambda, gcdout;
+    mpz_inits(pminus1, qminus1, lambda, gcdout, NULL);
+
+    do {
+        // Split the bits for p and q the same way rsa_make_pub does
+        uint64_t pbits = (random() % ((3 * nbits / 4) - (nbits / 4)) + 1) + (nbits / 4);
+        uint64_t qbits = nbits - pbits;
+
+        make_prime(p, pbits, iters);
+
+        do {
+            make_prime(q, qbits, iters);
+            mpz_mul(n, p, q);
+        } while (mpz_cmp(p, q) == 0 || mpz_sizeinbase(n, 2) < nbits);
+
+        // lambda(n) = lcm(p - 1, q - 1)
+        mpz_sub_ui(pminus1, p, 1);
+        mpz_sub_ui(qminus1, q, 1);
+        mpz_lcm(lambda, pminus1, qminus1);
+        gcd(gcdout, e, lambda);
+    } while (mpz_cmp_ui(gcdout, 1) != 0);
+
+    assert(mpz_sizeinbase(n, 2) == nbits);
+    mpz_clears(pminus1, qminus1, lambda, gcdout, NULL);
+}
+
 // Writes out public key components into a file
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
     // Write n, e, and s in hex format and username also with
+    uint64_t start = stats_start();
     gmp_fprintf(pbfile, "%Zx\n%Zx\n%Zx\n%s\n", n, e, s, username);
+    stats_stop(STAT_TIME_KEY_IO, start);
     return;
 }
 
@@ -91,21 +119,32 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
 
 // Given the totient and priv key -> write the file
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+    uint64_t start = stats_start();
     gmp_fprintf(pvfile, "%Zx\n%Zx\n", n, d);
+    stats_stop(STAT_TIME_KEY_IO, start);
     return;
 }
 
 // Signature of key is done by using pow_mod
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
+    uint64_t start = stats_start();
     pow_mod(s, m, d, n);
+    stats_stop(STAT_TIME_SIGNATURE, start);
     return;
 }
 
 // Key verification is done by checking if m is equal to s^e mod(n)
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
+    uint64_t start = stats_start();
     mpz_t tmp_m;
     mpz_init(tmp_m);
-    pow_mod(tmp_m, s, e, n);
+
+    if (mpz_fits_ulong_p(e)) {
+        pow_mod_ui(tmp_m, s, mpz_get_ui(e), n);
+    } else {
+        pow_mod(tmp_m, s, e, n);
+    }
+    stats_stop(STAT_TIME_SIGNATURE, start);
 
     if (mpz_cmp(m, tmp_m) == 0) {
         mpz_clear(tmp_m);
@@ -118,52 +157,295 @@ bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
 
 // Reads a public key hexstring
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
+    uint64_t start = stats_start();
     gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%s\n", n, e, s, username);
+    stats_stop(STAT_TIME_KEY_IO, start);
     return;
 }
 
 // Reads a private key hexstring
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
+    uint64_t start = stats_start();
     gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
+    stats_stop(STAT_TIME_KEY_IO, start);
     return;
 }
 
 // RSA encrypt performs a basic pow mod operation
+// Small exponents such as 65537 take the pow_mod_ui fast path
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
+    if (mpz_fits_ulong_p(e)) {
+        pow_mod_ui(c, m, mpz_get_ui(e), n);
+        return;
+    }
+
     pow_mod(c, m, e, n);
     return;
 }
 
+// One batch of blocks for the file loops
+// Each slot owns its block buffer and mpzs, so worker threads never share an output
+typedef struct {
+    uint8_t *blocks;
+    size_t *lens;
+    mpz_t *m;
+    mpz_t *c;
+    size_t k;
+    mpz_ptr n, e, d, p, q, dp, dq, qinv;
+} block_batch;
+
+// Allocates size slots of k bytes each
+// Returns false, with nothing left allocated, if the memory isn't available
+static bool batch_init(block_batch *b, size_t size, size_t k) {
+    bool fits = size > 0 && size <= SIZE_MAX / k;
+    b->blocks = fits ? (uint8_t *) calloc(size * k, sizeof(uint8_t)) : NULL;
+    b->lens = (size_t *) calloc(size, sizeof(size_t));
+    b->m = (mpz_t *) calloc(size, sizeof(mpz_t));
+    b->c = (mpz_t *) calloc(size, sizeof(mpz_t));
+    b->k = k;
+
+    if (b->blocks == NULL || b->lens == NULL || b->m == NULL || b->c == NULL) {
+        free(b->blocks);
+        free(b->lens);
+        free(b->m);
+        free(b->c);
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        mpz_inits(b->m[i], b->c[i], NULL);
+    }
+
+    return true;
+}
+
+static void batch_clear(block_batch *b, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        mpz_clears(b->m[i], b->c[i], NULL);
+    }
+
+    free(b->blocks);
+    free(b->lens);
+    free(b->m);
+    free(b->c);
+}
+
+static void encrypt_one(size_t i, void *arg) {
+    block_batch *b = (block_batch *) arg;
+    mpz_import(b->m[i], b->lens[i] + 1, 1, sizeof(uint8_t), 1, 0, b->blocks + i * b->k);
+    rsa_encrypt(b->c[i], b->m[i], b->e, b->n);
+}
+
 // Encrypts a file
-void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
+// Blocks are read tune_active.batch at a time and encrypted on tune_active.threads threads
+// Blocks are cut and written in the same order as a sequential run, so the output is unchanged
+// Returns false if the batch can't be allocated
+bool rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
     // Set a variable for number of bytes k
     // k = (log2(n) - 1) / 8 bytes
-    // Initialize mpz m
-    mpz_t m, c;
-    mpz_inits(m, c, NULL);
-    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8, size = tune_active.batch;
+    block_batch b;
 
-    // Dynamically allocate array
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    if (!batch_init(&b, size, k)) {
+        return false;
+    }
 
-    // Set zeroth byte of block to 0xFF
-    block[0] = 0xFF;
+    b.n = n;
+    b.e = e;
 
-    uint64_t j = 0, total_bytes = 0;
+    // Set zeroth byte of every block to 0xFF
+    for (size_t i = 0; i < size; i++) {
+        b.blocks[i * k] = 0xFF;
+    }
 
     // While the end of the file hasn't been reached:
-    // Read max/k - 1 bytes from infile in a single read
+    // Read max/k - 1 bytes from infile in a single read per block
+    // Reads and writes count as I/O time, import and encryption as math time
     while (feof(infile) == 0) {
+        size_t count = 0;
+        uint64_t start = stats_start();
+
+        while (count < size && feof(infile) == 0) {
+            b.lens[count] = fread(b.blocks + count * k + 1, sizeof(uint8_t), k - 1, infile);
+            stats_count(STAT_BYTES, b.lens[count]);
+            count += 1;
+        }
+
+        stats_stop(STAT_TIME_IO, start);
+
+        start = stats_start();
+        tune_parallel(count, encrypt_one, &b);
+        stats_stop(STAT_TIME_MATH, start);
+
+        start = stats_start();
+
+        for (size_t i = 0; i < count; i++) {
+            gmp_fprintf(outfile, "%Zx\n", b.c[i]);
+        }
+
+        stats_stop(STAT_TIME_IO, start);
+        stats_count(STAT_BLOCKS, count);
+    }
+
+    // Frees memory from the batch
+    batch_clear(&b, size);
+    return true;
+}
+
+// Fingerprints the key so an index written under another key is never reused
+// The format label makes indexes written in an older layout stale as well
+static void key_fingerprint(uint8_t digest[SHA256_DIGEST], mpz_t n, mpz_t e) {
+    static const char label[] = "rsa-index-v2";
+    char *n_hex = mpz_get_str(NULL, 16, n), *e_hex = mpz_get_str(NULL, 16, e);
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, label, sizeof(label));
+    sha256_update(&ctx, n_hex, strlen(n_hex) + 1);
+    sha256_update(&ctx, e_hex, strlen(e_hex) + 1);
+    sha256_final(&ctx, digest);
+    free(n_hex);
+    free(e_hex);
+}
+
+// Loads the entries of an index if it was written for the same key and block size
+// Each entry is the hash of a plaintext block followed by the hash of its ciphertext line
+// Returns the number of usable entries, 0 if the index is missing or stale
+static uint64_t read_index(FILE *idxfile, uint8_t fingerprint[SHA256_DIGEST], size_t k,
+    uint8_t **hashes) {
+    uint8_t stored[SHA256_DIGEST];
+    uint64_t stored_k = 0, count = 0;
+    *hashes = NULL;
+
+    if (idxfile == NULL || !sha256_fscan(idxfile, stored)
+        || memcmp(stored, fingerprint, SHA256_DIGEST) != 0
+        || fscanf(idxfile, "%" SCNx64 " %" SCNx64, &stored_k, &count) != 2 || stored_k != k
+        || count == 0 || count > SIZE_MAX / INDEX_ENTRY) {
+        return 0;
+    }
+
+    *hashes = (uint8_t *) malloc(count * INDEX_ENTRY);
+
+    for (uint64_t i = 0; *hashes != NULL && i < count; i++) {
+        if (!sha256_fscan(idxfile, *hashes + i * INDEX_ENTRY)
+            || !sha256_fscan(idxfile, *hashes + i * INDEX_ENTRY + SHA256_DIGEST)) {
+            return i;
+        }
+    }
+
+    return *hashes != NULL ? count : 0;
+}
+
+// Re-encrypts a file, reusing the ciphertext of every block whose content hash is unchanged
+// oldfile and old_idx hold the previous ciphertext and its index and may be NULL
+// Blocks are matched by position, so only in-place edits are incremental
+// An insertion or deletion shifts every later block and they are all re-encrypted
+// A reused line must also match the ciphertext hash in the index, so an outfile rewritten
+// since the index was made is never copied; from the first mismatch on, blocks are redone
+// The block loop matches rsa_encrypt_file exactly, so the output is identical to a full run
+// Returns false if memory for the new index can't be allocated
+bool rsa_encrypt_file_incremental(FILE *infile, FILE *outfile, FILE *oldfile, FILE *old_idx,
+    FILE *new_idx, mpz_t n, mpz_t e) {
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+
+    uint8_t fingerprint[SHA256_DIGEST], digest[SHA256_DIGEST], line_digest[SHA256_DIGEST];
+    uint8_t *old_hashes = NULL;
+    key_fingerprint(fingerprint, n, e);
+    uint64_t old_count = oldfile != NULL ? read_index(old_idx, fingerprint, k, &old_hashes) : 0;
+
+    // The new index is buffered so its block count can be written ahead of the hashes
+    uint64_t count = 0, capacity = old_count > 0 ? old_count : 64, j = 0;
+    uint8_t *hashes = (uint8_t *) malloc(capacity * INDEX_ENTRY);
+    char *line = NULL;
+    size_t line_cap = 0;
+    bool in_sync = old_count > 0, ok = block != NULL && hashes != NULL;
+
+    while (ok && feof(infile) == 0) {
+        block[0] = 0xFF;
+        uint64_t start = stats_start();
         j = fread(block + 1, sizeof(uint8_t), k - 1, infile);
-        total_bytes += j;
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
-        rsa_encrypt(c, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+        stats_stop(STAT_TIME_IO, start);
+
+        if (count == capacity) {
+            uint8_t *grown = capacity <= SIZE_MAX / (2 * INDEX_ENTRY)
+                                 ? (uint8_t *) realloc(hashes, 2 * capacity * INDEX_ENTRY)
+                                 : NULL;
+
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+
+            hashes = grown;
+            capacity *= 2;
+        }
+
+        uint8_t *entry = hashes + count * INDEX_ENTRY;
+        start = stats_start();
+        sha256(digest, block + 1, j);
+        memcpy(entry, digest, SHA256_DIGEST);
+        stats_stop(STAT_TIME_MATH, start);
+
+        // The old ciphertext is read line by line alongside the plaintext
+        // A line is reused only if both its plaintext and its own hash match the index
+        bool have_old = in_sync && count < old_count && getline(&line, &line_cap, oldfile) > 0;
+        uint8_t *old_entry = old_hashes + count * INDEX_ENTRY;
+        size_t line_len = have_old ? strcspn(line, "\n") : 0;
+
+        if (have_old) {
+            sha256(line_digest, line, line_len);
+            have_old = memcmp(old_entry + SHA256_DIGEST, line_digest, SHA256_DIGEST) == 0;
+        }
+
+        in_sync = have_old;
+
+        if (have_old && memcmp(old_entry, digest, SHA256_DIGEST) == 0) {
+            start = stats_start();
+            fprintf(outfile, "%.*s\n", (int) line_len, line);
+            stats_stop(STAT_TIME_IO, start);
+            memcpy(entry + SHA256_DIGEST, line_digest, SHA256_DIGEST);
+            stats_count(STAT_BLOCKS_REUSED, 1);
+        } else {
+            start = stats_start();
+            mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
+            rsa_encrypt(c, m, e, n);
+            char *hex = mpz_get_str(NULL, 16, c);
+            sha256(entry + SHA256_DIGEST, hex, strlen(hex));
+            stats_stop(STAT_TIME_MATH, start);
+
+            start = stats_start();
+            fprintf(outfile, "%s\n", hex);
+            stats_stop(STAT_TIME_IO, start);
+            free(hex);
+        }
+
+        stats_count(STAT_BYTES, j);
+        stats_count(STAT_BLOCKS, 1);
+        count += 1;
+    }
+
+    // Index: key fingerprint, block size, block count, then per block the plaintext hash and
+    // the ciphertext line hash
+    if (ok) {
+        sha256_fprint(new_idx, fingerprint);
+        fprintf(new_idx, "\n%zx\n%" PRIx64 "\n", k, count);
+
+        for (uint64_t i = 0; i < count; i++) {
+            sha256_fprint(new_idx, hashes + i * INDEX_ENTRY);
+            fprintf(new_idx, " ");
+            sha256_fprint(new_idx, hashes + i * INDEX_ENTRY + SHA256_DIGEST);
+            fprintf(new_idx, "\n");
+        }
     }
 
-    // Frees memory from mpz variables
     mpz_clears(m, c, NULL);
+    free(line);
+    free(hashes);
+    free(old_hashes);
     free(block);
+    return ok;
 }
 
 // RSA decrypt performs a basic pow mod operation
@@ -172,27 +454,91 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     return;
 }
 
-// Decrypts a file
-void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
-    // Initialize mpzs
-    mpz_t m, c;
-    mpz_inits(m, c, NULL);
+// RSA decrypt through the Chinese remainder theorem
+// Two half-size exponentiations mod p and q are recombined with Garner's formula
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv) {
+    mpz_t mp, mq, h;
+    mpz_inits(mp, mq, h, NULL);
+
+    // mp = c^dp mod p, mq = c^dq mod q
+    pow_mod(mp, c, dp, p);
+    pow_mod(mq, c, dq, q);
+
+    // m = mq + q * (qinv * (mp - mq) mod p)
+    mpz_sub(h, mp, mq);
+    mpz_mul(h, h, qinv);
+    mpz_mod(h, h, p);
+    mpz_mul(h, h, q);
+    mpz_add(m, mq, h);
+
+    mpz_clears(mp, mq, h, NULL);
+}
+
+// Decrypts one slot of a batch; CRT is used when p is not NULL
+static void decrypt_one(size_t i, void *arg) {
+    block_batch *b = (block_batch *) arg;
+
+    if (b->p != NULL) {
+        rsa_decrypt_crt(b->m[i], b->c[i], b->p, b->q, b->dp, b->dq, b->qinv);
+    } else {
+        rsa_decrypt(b->m[i], b->c[i], b->d, b->n);
+    }
+
+    mpz_export(b->blocks + i * b->k, &b->lens[i], 1, sizeof(uint8_t), 1, 0, b->m[i]);
+}
 
+// Shared block loop for both decrypt paths
+// Returns false if the batch can't be allocated
+static bool decrypt_blocks(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, mpz_t p, mpz_t q,
+    mpz_t dp, mpz_t dq, mpz_t qinv) {
     // Calculate block size k: k = log2(n) - 1 / 8
-    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8, ptr;
+    size_t k = (mpz_sizeinbase(n, 2) - 1) / 8, size = tune_active.batch;
+    block_batch b = { .n = n, .d = d, .p = p, .q = q, .dp = dp, .dq = dq, .qinv = qinv };
 
-    // Create dynamic array
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    if (!batch_init(&b, size, k)) {
+        return false;
+    }
 
-    // Scans until EOF is reached
+    // Scans until EOF is reached, a batch of blocks at a time
+    // Scanning and writing count as I/O time, decryption and export as math time
     while (feof(infile) == 0) {
-        gmp_fscanf(infile, "%Zx\n", c);
-        rsa_decrypt(m, c, d, n);
-        mpz_export(block, &ptr, 1, sizeof(uint8_t), 1, 0, m);
-        fwrite(block + 1, sizeof(uint8_t), ptr - 1, outfile);
+        size_t count = 0;
+        uint64_t start = stats_start();
+
+        while (count < size && feof(infile) == 0) {
+            gmp_fscanf(infile, "%Zx\n", b.c[count]);
+            count += 1;
+        }
+
+        stats_stop(STAT_TIME_IO, start);
+
+        start = stats_start();
+        tune_parallel(count, decrypt_one, &b);
+        stats_stop(STAT_TIME_MATH, start);
+
+        start = stats_start();
+
+        for (size_t i = 0; i < count; i++) {
+            fwrite(b.blocks + i * k + 1, sizeof(uint8_t), b.lens[i] - 1, outfile);
+            stats_count(STAT_BYTES, b.lens[i] - 1);
+        }
+
+        stats_stop(STAT_TIME_IO, start);
+        stats_count(STAT_BLOCKS, count);
     }
 
     // Frees up allocated memory
-    mpz_clears(m, c, NULL);
-    free(block);
+    batch_clear(&b, size);
+    return true;
+}
+
+// Decrypts a file
+bool rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    return decrypt_blocks(infile, outfile, n, d, NULL, NULL, NULL, NULL, NULL);
+}
+
+// Decrypts a file with the precomputed CRT values of a private key context
+bool rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv) {
+    return decrypt_blocks(infile, outfile, n, NULL, p, q, dp, dq, qinv);
 }
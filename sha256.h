@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SHA256_DIGEST 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    size_t used;
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST]);
+
+void sha256(uint8_t digest[SHA256_DIGEST], const void *data, size_t len);
+
+void sha256_fprint(FILE *f, uint8_t digest[SHA256_DIGEST]);
+
+bool sha256_fscan(FILE *f, uint8_t digest[SHA256_DIGEST]);
@@ -0,0 +1,141 @@
+#include "rsa.h"
+#include "numtheory.h"
+#include "stats.h"
+#include "treehash.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <gmp.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define OPTIONS "hvi:o:n:t:b:"
+
+// Long options for the instrumentation layer
+static struct option long_options[] = {
+    STATS_LONG_OPTIONS,
+    { NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    bool print_usage = false, print_verbose = false;
+    char *infile_name = NULL, *outfile_name = NULL, *priv_keyfile = "rsa.priv";
+    FILE *iFile = stdin, *oFile = stdout, *pvfile = NULL;
+    uint32_t threads = 4;
+    uint64_t chunk_size = TREEHASH_CHUNK;
+
+    // Parsing command-line options
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h': print_usage = true; break;
+        case 'v': print_verbose = true; break;
+        case 'i': infile_name = optarg; break;
+        case 'o': outfile_name = optarg; break;
+        case 'n': priv_keyfile = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'b': chunk_size = strtoull(optarg, NULL, 10); break;
+        default: print_usage = !stats_parse_option(opt, optarg); break;
+        }
+    }
+
+    // Print usage command-line option
+    if (print_usage) {
+        printf("SYNOPSIS\n");
+        printf("   Signs a file with a parallel Merkle tree hash and RSA.\n");
+        printf("   Signatures are checked by the verify program.\n\n");
+        printf("USAGE\n");
+        printf("   ./sign [-hv] [-i infile] [-o sigfile] [-t threads] [-b bytes] -n privkey\n\n");
+        printf("OPTIONS\n");
+        printf("   -h              Display program help and usage.\n");
+        printf("   -v              Display verbose program output.\n");
+        printf("   -i infile       Input file to sign (default: stdin).\n");
+        printf("   -o sigfile      Output file for the signature (default: stdout).\n");
+        printf("   -n pvfile       Private key file (default: rsa.priv).\n");
+        printf("   -t threads      Threads hashing chunks (default: 4).\n");
+        printf("   -b bytes        Chunk size of each leaf (default: 65536).\n");
+        printf(STATS_USAGE);
+    }
+
+    if (chunk_size == 0 || threads == 0) {
+        fprintf(stderr, "Chunk size and thread count must be positive.\n");
+        exit(1);
+    }
+
+    // Collection stays off unless -v or --stats is given
+    uint64_t run_start = stats_begin(print_verbose, print_usage);
+
+    // Opens private key file
+    if (priv_keyfile != NULL) {
+        pvfile = fopen(priv_keyfile, "r");
+
+        if (pvfile == NULL) {
+            fprintf(stderr, "Unable to open private keyfile.\n");
+            exit(1);
+        }
+    }
+
+    // Open input file if filename isn't NULL
+    if (infile_name != NULL) {
+        iFile = fopen(infile_name, "rb");
+
+        if (iFile == NULL) {
+            fprintf(stderr, "Failed to open infile.\n");
+            exit(1);
+        }
+    }
+
+    // Writes signature to outfile
+    if (outfile_name != NULL) {
+        oFile = fopen(outfile_name, "w");
+
+        if (oFile == NULL) {
+            fprintf(stderr, "Failed to open outfile.\n");
+            exit(1);
+        }
+    }
+
+    // Reading from private key file
+    mpz_t n, d, s;
+    mpz_inits(n, d, s, NULL);
+    rsa_read_priv(n, d, pvfile);
+
+    // Hashes the file and signs the root
+    treehash t;
+
+    if (!treehash_file(&t, iFile, chunk_size, threads)) {
+        fprintf(stderr, "Failed to hash infile.\n");
+        exit(1);
+    }
+
+    treehash_sign(s, &t, d, n);
+
+    if (!treehash_write(&t, s, oFile)) {
+        fprintf(stderr, "Failed to write the signature.\n");
+        exit(1);
+    }
+
+    // Print verbose command-line option
+    if (print_verbose && !print_usage) {
+        fprintf(stderr, "chunks = %" PRIu64 "\n", t.count);
+        gmp_fprintf(stderr, "s (%zu bits) = %Zu\n", mpz_sizeinbase(s, 2), s);
+    }
+
+    stats_end(run_start);
+
+    // Close the files and clear memory
+    treehash_clear(&t);
+    mpz_clears(n, d, s, NULL);
+    fclose(pvfile);
+
+    if (iFile != NULL) {
+        fclose(iFile);
+    }
+
+    if (oFile != NULL) {
+        fclose(oFile);
+    }
+}
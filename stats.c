@@ -0,0 +1,209 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+bool stats_enabled = false;
+
+uint64_t stats_counters[STAT_NUM_COUNTERS];
+
+uint64_t stats_timers[STAT_NUM_TIMERS];
+
+// Set by the shared long options
+static bool stats_requested = false, stats_json = false, stats_hw = false;
+
+static const char *counter_names[STAT_NUM_COUNTERS] = {
+    "mr_rounds",
+    "prime_candidates",
+    "prime_rejected",
+    "modexp",
+    "bytes",
+    "blocks",
+    "blocks_reused",
+};
+
+static const char *timer_names[STAT_NUM_TIMERS] = {
+    "total",
+    "make_prime",
+    "modexp_cpu",
+    "key_io",
+    "signature",
+    "io",
+    "math",
+};
+
+// Hardware counters are only available through perf_event_open on Linux
+#define NUM_HW_COUNTERS 4
+
+static const char *hw_names[NUM_HW_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "branch_misses",
+};
+
+static int hw_fds[NUM_HW_COUNTERS] = { -1, -1, -1, -1 };
+
+#ifdef __linux__
+static const uint64_t hw_configs[NUM_HW_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// Opens one user-space counter for this process, returning -1 if perf is unavailable
+static int hw_open(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Threads created later, such as the tune_parallel and treehash_file workers, are counted too
+    attr.inherit = 1;
+
+    int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    return fd;
+}
+#endif
+
+// Turns collection on, optionally with hardware counters
+void stats_enable(bool hw_counters) {
+    memset(stats_counters, 0, sizeof(stats_counters));
+    memset(stats_timers, 0, sizeof(stats_timers));
+    stats_enabled = true;
+
+    bool opened = false;
+
+#ifdef __linux__
+    for (int i = 0; hw_counters && i < NUM_HW_COUNTERS; i++) {
+        hw_fds[i] = hw_open(hw_configs[i]);
+        opened = opened || hw_fds[i] >= 0;
+    }
+#endif
+
+    if (hw_counters && !opened) {
+        fprintf(stderr, "Hardware counters are unavailable; perf_event_open isn't permitted.\n");
+    }
+}
+
+// Reads a hardware counter, returning false if it never opened
+static bool hw_read(int i, uint64_t *value) {
+    return hw_fds[i] >= 0 && read(hw_fds[i], value, sizeof(*value)) == sizeof(*value);
+}
+
+// Prints every counter and timer as a text summary or a single JSON object
+void stats_print(FILE *out, bool json) {
+    if (!stats_enabled) {
+        return;
+    }
+
+    uint64_t value = 0;
+
+    if (json) {
+        fprintf(out, "{\"counters\": {");
+
+        for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+            fprintf(out, "%s\"%s\": %" PRIu64, i == 0 ? "" : ", ", counter_names[i],
+                stats_counters[i]);
+        }
+
+        fprintf(out, "}, \"timers_ns\": {");
+
+        for (int i = 0; i < STAT_NUM_TIMERS; i++) {
+            fprintf(
+                out, "%s\"%s\": %" PRIu64, i == 0 ? "" : ", ", timer_names[i], stats_timers[i]);
+        }
+
+        fprintf(out, "}, \"hardware\": {");
+
+        for (int i = 0, printed = 0; i < NUM_HW_COUNTERS; i++) {
+            if (hw_read(i, &value)) {
+                fprintf(out, "%s\"%s\": %" PRIu64, printed++ == 0 ? "" : ", ", hw_names[i], value);
+            }
+        }
+
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "stats:\n");
+
+    for (int i = 0; i < STAT_NUM_COUNTERS; i++) {
+        fprintf(out, "   %-18s %" PRIu64 "\n", counter_names[i], stats_counters[i]);
+    }
+
+    for (int i = 0; i < STAT_NUM_TIMERS; i++) {
+        fprintf(out, "   %-18s %.6f s\n", timer_names[i], stats_timers[i] / 1e9);
+    }
+
+    for (int i = 0; i < NUM_HW_COUNTERS; i++) {
+        if (hw_read(i, &value)) {
+            fprintf(out, "   %-18s %" PRIu64 "\n", hw_names[i], value);
+        }
+    }
+}
+
+// Handles --stats[=text|json] and --hw-counters for a tool's getopt_long loop
+// Returns false for any other option, or for a --stats format that isn't text or json
+bool stats_parse_option(int opt, const char *arg) {
+    switch (opt) {
+    case OPT_STATS:
+        stats_requested = true;
+        stats_json = arg != NULL && strcmp(arg, "json") == 0;
+        return arg == NULL || stats_json || strcmp(arg, "text") == 0;
+    case OPT_HW_COUNTERS: stats_hw = true; return true;
+    default: return false;
+    }
+}
+
+// Turns collection on for -v or --stats, unless the tool is only printing usage
+// Collection otherwise stays off and every probe costs one branch
+// Returns the start of the run for stats_end
+uint64_t stats_begin(bool verbose, bool usage) {
+    if ((verbose || stats_requested) && !usage) {
+        stats_enable(stats_hw);
+    }
+
+    return stats_start();
+}
+
+// Prints the summary for the whole run to stderr, so it never mixes with output data
+void stats_end(uint64_t run_start) {
+    stats_stop(STAT_TIME_TOTAL, run_start);
+    stats_print(stderr, stats_json);
+    stats_finish();
+}
+
+// Closes any hardware counters and stops collection
+void stats_finish(void) {
+    for (int i = 0; i < NUM_HW_COUNTERS; i++) {
+        if (hw_fds[i] >= 0) {
+            close(hw_fds[i]);
+            hw_fds[i] = -1;
+        }
+    }
+
+    stats_enabled = false;
+}
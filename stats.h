@@ -0,0 +1,88 @@
+#pragma once
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Event counters bumped from the hot paths
+typedef enum {
+    STAT_MR_ROUNDS,
+    STAT_PRIME_CANDIDATES,
+    STAT_PRIME_REJECTED,
+    STAT_MODEXP,
+    STAT_BYTES,
+    STAT_BLOCKS,
+    STAT_BLOCKS_REUSED,
+    STAT_NUM_COUNTERS
+} stat_counter;
+
+// Monotonic timers, one per phase
+// Modexp time is summed over every thread that runs one, so it's CPU time and can exceed total
+typedef enum {
+    STAT_TIME_TOTAL,
+    STAT_TIME_PRIME,
+    STAT_TIME_MODEXP,
+    STAT_TIME_KEY_IO,
+    STAT_TIME_SIGNATURE,
+    STAT_TIME_IO,
+    STAT_TIME_MATH,
+    STAT_NUM_TIMERS
+} stat_timer;
+
+// Long options every tool accepts, placed first in its getopt_long table
+// Tool-specific long options are numbered from STATS_OPT_END
+enum { OPT_STATS = 256, OPT_HW_COUNTERS, STATS_OPT_END };
+
+#define STATS_LONG_OPTIONS                                                                         \
+    { "stats", optional_argument, NULL, OPT_STATS },                                               \
+    { "hw-counters", no_argument, NULL, OPT_HW_COUNTERS }
+
+#define STATS_USAGE                                                                                \
+    "   --stats[=json]  Print hot-path counters and phase timings (default: text).\n"               \
+    "   --hw-counters   Include hardware counters in the stats (Linux perf).\n"
+
+extern bool stats_enabled;
+
+extern uint64_t stats_counters[STAT_NUM_COUNTERS];
+
+extern uint64_t stats_timers[STAT_NUM_TIMERS];
+
+// Costs a single branch when stats are disabled
+// Relaxed atomics keep the totals exact when the file loops run on several threads
+static inline void stats_count(stat_counter c, uint64_t amount) {
+    if (stats_enabled) {
+        __atomic_fetch_add(&stats_counters[c], amount, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns a monotonic timestamp in nanoseconds, or 0 when stats are disabled
+static inline uint64_t stats_start(void) {
+    if (!stats_enabled) {
+        return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Adds the time elapsed since start to timer t
+static inline void stats_stop(stat_timer t, uint64_t start) {
+    if (stats_enabled) {
+        __atomic_fetch_add(&stats_timers[t], stats_start() - start, __ATOMIC_RELAXED);
+    }
+}
+
+bool stats_parse_option(int opt, const char *arg);
+
+uint64_t stats_begin(bool verbose, bool usage);
+
+void stats_end(uint64_t run_start);
+
+void stats_enable(bool hw_counters);
+
+void stats_print(FILE *out, bool json);
+
+void stats_finish(void);
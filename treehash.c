@@ -0,0 +1,408 @@
+#include "treehash.h"
+#include "rsa.h"
+#include "sha256.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <gmp.h>
+
+// Chunks read per thread in each batch before the workers are joined
+#define CHUNKS_PER_THREAD 4
+
+// Leaves and interior nodes are domain separated so one can't pose as the other
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+// Hashes one chunk of the file into a leaf
+void treehash_leaf(uint8_t digest[SHA256_DIGEST], const uint8_t *chunk, size_t len) {
+    sha256_ctx ctx;
+    uint8_t prefix = LEAF_PREFIX;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, chunk, len);
+    sha256_final(&ctx, digest);
+}
+
+// Hashes two children into their parent
+static void node_hash(uint8_t digest[SHA256_DIGEST], const uint8_t left[SHA256_DIGEST],
+    const uint8_t right[SHA256_DIGEST]) {
+    sha256_ctx ctx;
+    uint8_t prefix = NODE_PREFIX;
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, SHA256_DIGEST);
+    sha256_update(&ctx, right, SHA256_DIGEST);
+    sha256_final(&ctx, digest);
+}
+
+// Replaces a level of width nodes with its parent level in place, returning the new width
+// An odd node at the end is carried up unchanged
+static uint64_t reduce_level(uint8_t *level, uint64_t width) {
+    uint64_t parents = 0;
+
+    for (uint64_t i = 0; i < width; i += 2, parents++) {
+        if (i + 1 < width) {
+            node_hash(level + parents * SHA256_DIGEST, level + i * SHA256_DIGEST,
+                level + (i + 1) * SHA256_DIGEST);
+        } else {
+            memmove(level + parents * SHA256_DIGEST, level + i * SHA256_DIGEST, SHA256_DIGEST);
+        }
+    }
+
+    return parents;
+}
+
+// A contiguous run of chunks in the batch buffer for one worker
+typedef struct {
+    const uint8_t *buf;
+    uint64_t chunk_size;
+    uint64_t bytes;
+    uint64_t first;
+    uint64_t last;
+    uint8_t *leaves;
+} leaf_job;
+
+static void *leaf_worker(void *arg) {
+    leaf_job *job = (leaf_job *) arg;
+
+    for (uint64_t i = job->first; i < job->last; i++) {
+        uint64_t offset = i * job->chunk_size;
+        uint64_t len = job->bytes - offset < job->chunk_size ? job->bytes - offset : job->chunk_size;
+        treehash_leaf(job->leaves + i * SHA256_DIGEST, job->buf + offset, len);
+    }
+
+    return NULL;
+}
+
+// Streams a file through the tree hash, hashing the chunks of each batch on threads workers
+bool treehash_file(treehash *t, FILE *infile, uint64_t chunk_size, uint32_t threads) {
+    threads = threads == 0 ? 1 : threads;
+    uint64_t batch = (uint64_t) threads * CHUNKS_PER_THREAD, capacity = batch;
+    uint8_t *buf = (uint8_t *) malloc(batch * chunk_size);
+    pthread_t *workers = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    leaf_job *jobs = (leaf_job *) calloc(threads, sizeof(leaf_job));
+
+    t->chunk_size = chunk_size;
+    t->file_size = 0;
+    t->count = 0;
+    t->leaves = (uint8_t *) malloc(capacity * SHA256_DIGEST);
+
+    if (buf == NULL || workers == NULL || jobs == NULL || t->leaves == NULL) {
+        free(buf);
+        free(workers);
+        free(jobs);
+        treehash_clear(t);
+        return false;
+    }
+
+    while (feof(infile) == 0) {
+        uint64_t start = stats_start();
+        uint64_t bytes = fread(buf, sizeof(uint8_t), batch * chunk_size, infile);
+        stats_stop(STAT_TIME_IO, start);
+
+        // An empty file still gets one empty leaf so the tree has a root
+        if (bytes == 0 && t->count > 0) {
+            break;
+        }
+
+        uint64_t chunks = bytes == 0 ? 1 : (bytes + chunk_size - 1) / chunk_size;
+
+        if (t->count + chunks > capacity) {
+            capacity *= 2;
+            uint8_t *grown = (uint8_t *) realloc(t->leaves, capacity * SHA256_DIGEST);
+
+            if (grown == NULL) {
+                free(buf);
+                free(workers);
+                free(jobs);
+                treehash_clear(t);
+                return false;
+            }
+
+            t->leaves = grown;
+        }
+
+        // Splits the batch into one contiguous run of chunks per worker
+        start = stats_start();
+
+        for (uint32_t w = 0; w < threads; w++) {
+            jobs[w].buf = buf;
+            jobs[w].chunk_size = chunk_size;
+            jobs[w].bytes = bytes;
+            jobs[w].first = chunks * w / threads;
+            jobs[w].last = chunks * (w + 1) / threads;
+            jobs[w].leaves = t->leaves + t->count * SHA256_DIGEST;
+
+            if (jobs[w].first == jobs[w].last) {
+                continue;
+            }
+
+            if (threads == 1 || pthread_create(&workers[w], NULL, leaf_worker, &jobs[w]) != 0) {
+                leaf_worker(&jobs[w]);
+                jobs[w].first = jobs[w].last;
+            }
+        }
+
+        for (uint32_t w = 0; w < threads; w++) {
+            if (jobs[w].first != jobs[w].last) {
+                pthread_join(workers[w], NULL);
+            }
+        }
+
+        stats_stop(STAT_TIME_MATH, start);
+        stats_count(STAT_BYTES, bytes);
+        stats_count(STAT_BLOCKS, chunks);
+
+        t->count += chunks;
+        t->file_size += bytes;
+    }
+
+    free(buf);
+    free(workers);
+    free(jobs);
+
+    if (!treehash_root(t)) {
+        treehash_clear(t);
+        return false;
+    }
+
+    return true;
+}
+
+// Computes the Merkle root from the stored leaves into t->root
+bool treehash_root(treehash *t) {
+    uint8_t *level = (uint8_t *) malloc(t->count * SHA256_DIGEST);
+
+    if (level == NULL) {
+        return false;
+    }
+
+    memcpy(level, t->leaves, t->count * SHA256_DIGEST);
+
+    for (uint64_t width = t->count; width > 1;) {
+        width = reduce_level(level, width);
+    }
+
+    memcpy(t->root, level, SHA256_DIGEST);
+    free(level);
+    return true;
+}
+
+// Number of nodes on every level of a tree with count leaves, root included
+static uint64_t tree_nodes(uint64_t count) {
+    uint64_t nodes = count;
+
+    for (uint64_t width = count; width > 1;) {
+        width = (width + 1) / 2;
+        nodes += width;
+    }
+
+    return nodes;
+}
+
+// Walks a proof path from a leaf hash and checks that it lands on the root
+// The path holds one sibling per level, skipping levels where the node is carried up alone
+bool treehash_verify_proof(treehash *t, uint8_t leaf[SHA256_DIGEST], uint64_t index,
+    uint8_t path[][SHA256_DIGEST], uint64_t path_len) {
+    uint8_t digest[SHA256_DIGEST];
+    uint64_t used = 0;
+    memcpy(digest, leaf, SHA256_DIGEST);
+
+    if (index >= t->count) {
+        return false;
+    }
+
+    for (uint64_t width = t->count; width > 1; width = (width + 1) / 2, index /= 2) {
+        if ((index ^ 1) >= width) {
+            continue;
+        }
+
+        if (used == path_len) {
+            return false;
+        }
+
+        if (index % 2 == 1) {
+            node_hash(digest, path[used], digest);
+        } else {
+            node_hash(digest, digest, path[used]);
+        }
+
+        used += 1;
+    }
+
+    return used == path_len && memcmp(digest, t->root, SHA256_DIGEST) == 0;
+}
+
+// Converts the root into the message that gets signed
+// The root is reduced mod n so keys smaller than 256 bits can still sign it
+static void root_message(mpz_t m, treehash *t, mpz_t n) {
+    mpz_import(m, SHA256_DIGEST, 1, sizeof(uint8_t), 1, 0, t->root);
+    mpz_mod(m, m, n);
+}
+
+// Signs the Merkle root with rsa_sign
+void treehash_sign(mpz_t s, treehash *t, mpz_t d, mpz_t n) {
+    mpz_t m;
+    mpz_init(m);
+    root_message(m, t, n);
+    rsa_sign(s, m, d, n);
+    mpz_clear(m);
+}
+
+// Verifies a signature over the Merkle root with rsa_verify
+bool treehash_verify(treehash *t, mpz_t s, mpz_t e, mpz_t n) {
+    mpz_t m;
+    mpz_init(m);
+    root_message(m, t, n);
+    bool verified = rsa_verify(m, s, e, n);
+    mpz_clear(m);
+    return verified;
+}
+
+// Writes the chunk size, file size, leaf count, root and signature in hex
+// Every level of the tree follows, leaves first and root last, one node per line
+// Each node line is the same length, so a proof can seek straight to the nodes it needs
+bool treehash_write(treehash *t, mpz_t s, FILE *sigfile) {
+    uint8_t *level = (uint8_t *) malloc(t->count * SHA256_DIGEST);
+
+    if (level == NULL) {
+        return false;
+    }
+
+    memcpy(level, t->leaves, t->count * SHA256_DIGEST);
+    fprintf(sigfile, "%" PRIx64 "\n%" PRIx64 "\n%" PRIx64 "\n", t->chunk_size, t->file_size,
+        t->count);
+
+    sha256_fprint(sigfile, t->root);
+    gmp_fprintf(sigfile, "\n%Zx\n", s);
+
+    for (uint64_t width = t->count;; width = reduce_level(level, width)) {
+        for (uint64_t i = 0; i < width; i++) {
+            sha256_fprint(sigfile, level + i * SHA256_DIGEST);
+            fprintf(sigfile, "\n");
+        }
+
+        if (width == 1) {
+            break;
+        }
+    }
+
+    free(level);
+    return true;
+}
+
+// Reads the header of a signature file up to the first node line
+// The counts come from the file, so the nodes must fit in memory and in what's left of it
+static bool read_header(treehash *t, mpz_t s, FILE *sigfile) {
+    memset(t, 0, sizeof(*t));
+
+    if (fscanf(sigfile, "%" SCNx64 " %" SCNx64 " %" SCNx64 " ", &t->chunk_size, &t->file_size,
+            &t->count)
+            != 3
+        || t->count == 0 || t->chunk_size == 0
+        || t->count
+               != (t->file_size == 0 ? 1
+                                     : t->file_size / t->chunk_size
+                                           + (t->file_size % t->chunk_size != 0))
+        || !sha256_fscan(sigfile, t->root) || gmp_fscanf(sigfile, "%Zx", s) != 1
+        || fgetc(sigfile) != '\n') {
+        return false;
+    }
+
+    // Each node takes a hex digest plus a newline
+    struct stat st;
+    off_t pos = ftello(sigfile);
+
+    if (t->count > SIZE_MAX / SHA256_DIGEST
+        || (fstat(fileno(sigfile), &st) == 0 && S_ISREG(st.st_mode) && pos >= 0
+            && tree_nodes(t->count) > (uint64_t) (st.st_size - pos) / (2 * SHA256_DIGEST + 1))) {
+        return false;
+    }
+
+    return true;
+}
+
+// Reads a signature file and its leaves, rejecting it if the stored root doesn't match them
+// The interior levels are skipped; the root is rebuilt from the leaves once, here
+bool treehash_read(treehash *t, mpz_t s, FILE *sigfile) {
+    uint8_t stored[SHA256_DIGEST];
+
+    if (!read_header(t, s, sigfile)) {
+        return false;
+    }
+
+    memcpy(stored, t->root, SHA256_DIGEST);
+    t->leaves = (uint8_t *) malloc(t->count * SHA256_DIGEST);
+
+    if (t->leaves == NULL) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < t->count; i++) {
+        if (!sha256_fscan(sigfile, t->leaves + i * SHA256_DIGEST)) {
+            treehash_clear(t);
+            return false;
+        }
+    }
+
+    if (!treehash_root(t) || memcmp(t->root, stored, SHA256_DIGEST) != 0) {
+        treehash_clear(t);
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the header of a signature file and the sibling path of one leaf
+// Only the log-many sibling nodes are read, found by seeking to their fixed-size lines
+// The path isn't trusted here; treehash_verify_proof checks it against the stored root
+bool treehash_read_proof(treehash *t, mpz_t s, FILE *sigfile, uint64_t index,
+    uint8_t path[][SHA256_DIGEST], uint64_t *path_len) {
+    // Every node offset must fit in an off_t
+    if (!read_header(t, s, sigfile) || index >= t->count
+        || t->count > (uint64_t) INT64_MAX / (4 * (2 * SHA256_DIGEST + 1))) {
+        return false;
+    }
+
+    off_t nodes = ftello(sigfile);
+    uint64_t level_start = 0;
+    *path_len = 0;
+
+    if (nodes < 0) {
+        return false;
+    }
+
+    for (uint64_t width = t->count; width > 1; width = (width + 1) / 2, index /= 2) {
+        uint64_t sibling = index ^ 1;
+
+        // A node carried up without a sibling contributes nothing to the path
+        if (sibling < width) {
+            off_t offset
+                = nodes + (off_t) ((level_start + sibling) * (2 * SHA256_DIGEST + 1));
+
+            if (*path_len == TREEHASH_MAX_DEPTH || fseeko(sigfile, offset, SEEK_SET) != 0
+                || !sha256_fscan(sigfile, path[*path_len])) {
+                return false;
+            }
+
+            *path_len += 1;
+        }
+
+        level_start += width;
+    }
+
+    return true;
+}
+
+void treehash_clear(treehash *t) {
+    free(t->leaves);
+    t->leaves = NULL;
+    t->count = 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "sha256.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+
+#define TREEHASH_CHUNK     65536
+#define TREEHASH_MAX_DEPTH 64
+
+// Merkle tree over fixed-size chunks of a file
+// The leaf hashes and the root are kept; interior levels are rebuilt on demand
+// leaves is NULL for a tree read with treehash_read_proof
+typedef struct {
+    uint64_t chunk_size;
+    uint64_t file_size;
+    uint64_t count;
+    uint8_t *leaves;
+    uint8_t root[SHA256_DIGEST];
+} treehash;
+
+void treehash_leaf(uint8_t digest[SHA256_DIGEST], const uint8_t *chunk, size_t len);
+
+bool treehash_file(treehash *t, FILE *infile, uint64_t chunk_size, uint32_t threads);
+
+bool treehash_root(treehash *t);
+
+bool treehash_verify_proof(treehash *t, uint8_t leaf[SHA256_DIGEST], uint64_t index,
+    uint8_t path[][SHA256_DIGEST], uint64_t path_len);
+
+void treehash_sign(mpz_t s, treehash *t, mpz_t d, mpz_t n);
+
+bool treehash_verify(treehash *t, mpz_t s, mpz_t e, mpz_t n);
+
+bool treehash_write(treehash *t, mpz_t s, FILE *sigfile);
+
+bool treehash_read(treehash *t, mpz_t s, FILE *sigfile);
+
+bool treehash_read_proof(treehash *t, mpz_t s, FILE *sigfile, uint64_t index,
+    uint8_t path[][SHA256_DIGEST], uint64_t *path_len);
+
+void treehash_clear(treehash *t);
@@ -0,0 +1,332 @@
+#include "tune.h"
+#include "numtheory.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Untuned runs keep the original single-threaded binary pow_mod
+tune_profile tune_active = { TUNE_KERNEL_BINARY, 1, 1, 1 };
+
+static const char *kernel_names[] = { "binary", "window", "gmp" };
+
+const char *tune_kernel_name(tune_kernel kernel) {
+    return kernel_names[kernel];
+}
+
+// Describes the CPU as vendor-family-model-stepping plus the features that matter to bignum code
+// The string keys the cache, so a profile is never reused on different hardware
+void tune_cpu_signature(char *signature, size_t len) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    char vendor[13] = { 0 };
+
+    if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0) {
+        snprintf(signature, len, "x86-unknown");
+        return;
+    }
+
+    memcpy(vendor, &ebx, 4);
+    memcpy(vendor + 4, &edx, 4);
+    memcpy(vendor + 8, &ecx, 4);
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    unsigned int family = ((eax >> 8) & 0xF) + ((eax >> 20) & 0xFF);
+    unsigned int model = ((eax >> 4) & 0xF) | ((eax >> 12) & 0xF0);
+    unsigned int stepping = eax & 0xF;
+    bool avx = (ecx >> 28) & 1;
+
+    // Leaf 7 reports BMI2 (mulx) and ADX (adcx/adox), which GMP's fastest mul loops use
+    bool bmi2 = false, adx = false, avx2 = false;
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0) {
+        bmi2 = (ebx >> 8) & 1;
+        adx = (ebx >> 19) & 1;
+        avx2 = (ebx >> 5) & 1;
+    }
+
+    snprintf(signature, len, "%s-%u-%u-%u%s%s%s%s", vendor, family, model, stepping,
+        avx ? "+avx" : "", avx2 ? "+avx2" : "", bmi2 ? "+bmi2" : "", adx ? "+adx" : "");
+#else
+    snprintf(signature, len, "generic");
+#endif
+}
+
+// Runs fn for every index below count on up to tune_active.threads threads
+typedef struct {
+    size_t first;
+    size_t stride;
+    size_t count;
+    void (*fn)(size_t i, void *arg);
+    void *arg;
+} parallel_job;
+
+static void *parallel_worker(void *arg) {
+    parallel_job *job = (parallel_job *) arg;
+
+    for (size_t i = job->first; i < job->count; i += job->stride) {
+        job->fn(i, job->arg);
+    }
+
+    return NULL;
+}
+
+void tune_parallel(size_t count, void (*fn)(size_t i, void *arg), void *arg) {
+    size_t threads = tune_active.threads < count ? tune_active.threads : count;
+
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            fn(i, arg);
+        }
+
+        return;
+    }
+
+    pthread_t workers[TUNE_MAX_THREADS];
+    parallel_job jobs[TUNE_MAX_THREADS];
+    bool started[TUNE_MAX_THREADS];
+
+    for (size_t t = 0; t < threads; t++) {
+        jobs[t] = (parallel_job) { t, threads, count, fn, arg };
+        started[t] = pthread_create(&workers[t], NULL, parallel_worker, &jobs[t]) == 0;
+
+        // Falls back to running the share inline if a thread can't be started
+        if (!started[t]) {
+            parallel_worker(&jobs[t]);
+        }
+    }
+
+    for (size_t t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+        }
+    }
+}
+
+// Returns the current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+// Operands for the tuning runs, one base per slot so threads never share an output
+typedef struct {
+    mpz_t *a;
+    mpz_t *o;
+    mpz_ptr d;
+    mpz_ptr n;
+} tune_work;
+
+static void tune_one(size_t i, void *arg) {
+    tune_work *w = (tune_work *) arg;
+    pow_mod(w->o[i], w->a[i], w->d, w->n);
+}
+
+// Times total modexps run in batches of width batch under profile p
+static uint64_t time_profile(tune_profile *p, tune_work *w, size_t total, size_t batch) {
+    tune_profile saved = tune_active;
+    tune_active = *p;
+    uint64_t start = now_ns();
+
+    for (size_t done = 0; done < total; done += batch) {
+        tune_work slice = { w->a + done, w->o + done, w->d, w->n };
+        tune_parallel(total - done < batch ? total - done : batch, tune_one, &slice);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    tune_active = saved;
+    return elapsed;
+}
+
+// Picks the fastest kernel and window for bits-bit moduli, then the thread count and batch width
+// A private random state keeps tuning from disturbing seeded key generation
+void tune_run(tune_profile *profile, uint64_t bits) {
+    const size_t total = 64;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads
+        = cpus < 1 ? 1 : (cpus > TUNE_MAX_THREADS ? TUNE_MAX_THREADS : (uint32_t) cpus);
+
+    gmp_randstate_t tune_state;
+    gmp_randinit_mt(tune_state);
+    gmp_randseed_ui(tune_state, 1);
+
+    mpz_t n, d;
+    mpz_inits(n, d, NULL);
+    mpz_t *a = (mpz_t *) malloc(total * sizeof(mpz_t));
+    mpz_t *o = (mpz_t *) malloc(total * sizeof(mpz_t));
+
+    // Full-size exponent, so the measurement reflects private-key work
+    mpz_urandomb(n, tune_state, bits);
+    mpz_setbit(n, bits - 1);
+    mpz_setbit(n, 0);
+    mpz_urandomm(d, tune_state, n);
+
+    for (size_t i = 0; i < total; i++) {
+        mpz_init(a[i]);
+        mpz_init(o[i]);
+        mpz_urandomm(a[i], tune_state, n);
+    }
+
+    tune_work work = { a, o, d, n };
+
+    // Kernel and window on one thread; fewer repetitions for large moduli
+    tune_profile candidates[TUNE_MAX_WINDOW + 1];
+    size_t num_candidates = 0;
+    candidates[num_candidates++] = (tune_profile) { TUNE_KERNEL_BINARY, 1, 1, 1 };
+
+    for (uint32_t w = 2; w <= TUNE_MAX_WINDOW; w++) {
+        candidates[num_candidates++] = (tune_profile) { TUNE_KERNEL_WINDOW, w, 1, 1 };
+    }
+
+    candidates[num_candidates++] = (tune_profile) { TUNE_KERNEL_GMP, 1, 1, 1 };
+
+    size_t reps = bits >= 4096 ? 1 : 4;
+    tune_profile best = candidates[0];
+    uint64_t best_ns = UINT64_MAX;
+
+    for (size_t c = 0; c < num_candidates; c++) {
+        uint64_t ns = time_profile(&candidates[c], &work, reps, 1);
+
+        if (ns < best_ns) {
+            best = candidates[c];
+            best_ns = ns;
+        }
+    }
+
+    // Threads and batch width on the chosen kernel
+    // Large moduli are timed on fewer operands to bound the one-time cost
+    size_t batch_total = bits >= 4096 ? 4 * max_threads : total;
+    batch_total = batch_total > total ? total : batch_total;
+    best_ns = UINT64_MAX;
+    tune_profile chosen = best;
+
+    for (uint32_t t = 1; t <= max_threads; t *= 2) {
+        for (uint32_t b = t; b <= 16 * t && b <= batch_total; b *= 4) {
+            tune_profile candidate = { best.kernel, best.window, t, b };
+            uint64_t ns = time_profile(&candidate, &work, batch_total, b);
+
+            if (ns < best_ns) {
+                chosen = candidate;
+                best_ns = ns;
+            }
+        }
+    }
+
+    *profile = chosen;
+
+    for (size_t i = 0; i < total; i++) {
+        mpz_clear(a[i]);
+        mpz_clear(o[i]);
+    }
+
+    free(a);
+    free(o);
+    mpz_clears(n, d, NULL);
+    gmp_randclear(tune_state);
+}
+
+// Looks for a profile for this CPU and modulus size in the cache file
+static bool cache_lookup(FILE *cache, const char *signature, uint64_t bits, tune_profile *p) {
+    char sig[256], kernel[16];
+    uint64_t cached_bits;
+    tune_profile found;
+
+    while (fscanf(cache, "%255s %" SCNu64 " %15s %" SCNu32 " %" SCNu32 " %" SCNu32, sig,
+               &cached_bits, kernel, &found.window, &found.threads, &found.batch)
+           == 6) {
+        if (strcmp(sig, signature) != 0 || cached_bits != bits) {
+            continue;
+        }
+
+        for (int k = TUNE_KERNEL_BINARY; k <= TUNE_KERNEL_GMP; k++) {
+            if (strcmp(kernel, kernel_names[k]) == 0 && found.window >= 1
+                && found.window <= TUNE_MAX_WINDOW && found.threads >= 1
+                && found.threads <= TUNE_MAX_THREADS && found.batch >= 1
+                && found.batch <= TUNE_MAX_BATCH) {
+                found.kernel = (tune_kernel) k;
+                *p = found;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Makes tune_active the profile for bits-bit moduli on this CPU
+// A cached profile is used when there is one; otherwise tuning runs once and is appended
+// Returns true if the profile came from the cache
+bool tune_load(uint64_t bits, const char *cache_path) {
+    char signature[256];
+    tune_cpu_signature(signature, sizeof(signature));
+    FILE *cache = fopen(cache_path, "r");
+
+    if (cache != NULL) {
+        bool hit = cache_lookup(cache, signature, bits, &tune_active);
+        fclose(cache);
+
+        if (hit) {
+            return true;
+        }
+    }
+
+    // Collection is paused so the trial runs don't show up in the tool's own stats
+    bool collecting = stats_enabled;
+    stats_enabled = false;
+    tune_run(&tune_active, bits);
+    stats_enabled = collecting;
+    cache = fopen(cache_path, "a");
+
+    // Caching is best effort; a read-only directory just means tuning again next time
+    if (cache != NULL) {
+        fprintf(cache, "%s %" PRIu64 " %s %" PRIu32 " %" PRIu32 " %" PRIu32 "\n", signature, bits,
+            tune_kernel_name(tune_active.kernel), tune_active.window, tune_active.threads,
+            tune_active.batch);
+        fclose(cache);
+    }
+
+    return false;
+}
+
+// Set by --no-tune
+static bool tune_disabled = false;
+
+// Handles --no-tune for a tool's getopt_long loop
+// Returns false for any other option
+bool tune_parse_option(int opt) {
+    if (opt != OPT_NO_TUNE) {
+        return false;
+    }
+
+    tune_disabled = true;
+    return true;
+}
+
+// Loads or tunes the profile for bits-bit moduli unless --no-tune was given or the tool
+// is only printing usage, and reports the profile on stderr with -v
+void tune_begin(uint64_t bits, bool verbose, bool usage) {
+    if (tune_disabled || usage) {
+        return;
+    }
+
+    bool cached = tune_load(bits, TUNE_CACHE_FILE);
+
+    if (verbose) {
+        fprintf(stderr, "tune = kernel %s, window %" PRIu32 ", threads %" PRIu32 ", batch %" PRIu32
+            " (%s)\n", tune_kernel_name(tune_active.kernel), tune_active.window,
+            tune_active.threads, tune_active.batch, cached ? "cached" : "tuned");
+    }
+}
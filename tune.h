@@ -0,0 +1,52 @@
+#pragma once
+
+#include "stats.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TUNE_CACHE_FILE "rsa.tune"
+
+// Long option shared by the tools that autotune, numbered after the stats options
+enum { OPT_NO_TUNE = STATS_OPT_END, TUNE_OPT_END };
+
+#define TUNE_LONG_OPTION { "no-tune", no_argument, NULL, OPT_NO_TUNE }
+
+#define TUNE_USAGE                                                                                 \
+    "   --no-tune       Skip the autotuner and use the untuned single-threaded path.\n"
+
+// Limits on a profile; tune_run never picks more than 16 blocks per thread
+#define TUNE_MAX_WINDOW  6
+#define TUNE_MAX_THREADS 64
+#define TUNE_MAX_BATCH   (16 * TUNE_MAX_THREADS)
+
+// Arithmetic kernels pow_mod can dispatch to
+typedef enum { TUNE_KERNEL_BINARY, TUNE_KERNEL_WINDOW, TUNE_KERNEL_GMP } tune_kernel;
+
+// A tuned configuration for one CPU and modulus size
+// batch is the number of blocks the file loops read before fanning out to threads
+typedef struct {
+    tune_kernel kernel;
+    uint32_t window;
+    uint32_t threads;
+    uint32_t batch;
+} tune_profile;
+
+extern tune_profile tune_active;
+
+const char *tune_kernel_name(tune_kernel kernel);
+
+void tune_cpu_signature(char *signature, size_t len);
+
+void tune_run(tune_profile *profile, uint64_t bits);
+
+bool tune_load(uint64_t bits, const char *cache_path);
+
+bool tune_parse_option(int opt);
+
+void tune_begin(uint64_t bits, bool verbose, bool usage);
+
+void tune_parallel(size_t count, void (*fn)(size_t i, void *arg), void *arg);
@@ -0,0 +1,184 @@
+#include "rsa.h"
+#include "numtheory.h"
+#include "stats.h"
+#include "treehash.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <gmp.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define OPTIONS "hvi:s:n:t:k:"
+
+// Long options for the instrumentation layer
+static struct option long_options[] = {
+    STATS_LONG_OPTIONS,
+    { NULL, 0, NULL, 0 },
+};
+
+// Rechecks a single chunk against the signed root through its sibling path
+// Only that chunk and the log-many nodes on its path are read
+static bool verify_chunk(treehash *t, FILE *infile, uint64_t index,
+    uint8_t path[][SHA256_DIGEST], uint64_t path_len) {
+    uint8_t leaf[SHA256_DIGEST];
+    uint8_t *chunk = (uint8_t *) malloc(t->chunk_size);
+
+    if (chunk == NULL || index >= t->count || index > (uint64_t) INT64_MAX / t->chunk_size
+        || fseeko(infile, (off_t) (index * t->chunk_size), SEEK_SET) != 0) {
+        free(chunk);
+        return false;
+    }
+
+    uint64_t start = stats_start();
+    size_t len = fread(chunk, sizeof(uint8_t), t->chunk_size, infile);
+    stats_stop(STAT_TIME_IO, start);
+
+    start = stats_start();
+    treehash_leaf(leaf, chunk, len);
+    bool verified = treehash_verify_proof(t, leaf, index, path, path_len);
+    stats_stop(STAT_TIME_MATH, start);
+    stats_count(STAT_BYTES, len);
+    stats_count(STAT_BLOCKS, 1);
+
+    free(chunk);
+    return verified;
+}
+
+int main(int argc, char **argv) {
+    int opt = 0;
+    bool print_usage = false, print_verbose = false, check_chunk = false;
+    char *infile_name = NULL, *sigfile_name = NULL, *pb_keyfile = "rsa.pub";
+    FILE *iFile = NULL, *sigfile = NULL, *pbfile = NULL;
+    uint32_t threads = 4;
+    uint64_t chunk_index = 0;
+
+    // Parsing command-line options
+    while ((opt = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h': print_usage = true; break;
+        case 'v': print_verbose = true; break;
+        case 'i': infile_name = optarg; break;
+        case 's': sigfile_name = optarg; break;
+        case 'n': pb_keyfile = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'k':
+            check_chunk = true;
+            chunk_index = strtoull(optarg, NULL, 10);
+            break;
+        default: print_usage = !stats_parse_option(opt, optarg); break;
+        }
+    }
+
+    // Print usage command-line option
+    if (print_usage) {
+        printf("SYNOPSIS\n");
+        printf("   Verifies a Merkle tree signature made by the sign program.\n");
+        printf("   With -k only one chunk of the file is read and checked.\n\n");
+        printf("USAGE\n");
+        printf("   ./verify [-hv] [-t threads] [-k chunk] -i infile -s sigfile -n pubkey\n\n");
+        printf("OPTIONS\n");
+        printf("   -h              Display program help and usage.\n");
+        printf("   -v              Display verbose program output.\n");
+        printf("   -i infile       Signed file to check.\n");
+        printf("   -s sigfile      Signature written by sign.\n");
+        printf("   -n pbfile       Public key file (default: rsa.pub).\n");
+        printf("   -t threads      Threads hashing chunks (default: 4).\n");
+        printf("   -k chunk        Verify only this chunk through its path to the signed root.\n");
+        printf(STATS_USAGE);
+        return 0;
+    }
+
+    if (infile_name == NULL || sigfile_name == NULL || threads == 0) {
+        fprintf(stderr, "An infile, a sigfile and a positive thread count are required.\n");
+        exit(1);
+    }
+
+    // Collection stays off unless -v or --stats is given
+    uint64_t run_start = stats_begin(print_verbose, false);
+
+    // Opens the public key, signature and signed file
+    pbfile = fopen(pb_keyfile, "r");
+    sigfile = fopen(sigfile_name, "r");
+    iFile = fopen(infile_name, "rb");
+
+    if (pbfile == NULL || sigfile == NULL || iFile == NULL) {
+        fprintf(stderr, "Unable to open %s.\n",
+            pbfile == NULL ? pb_keyfile : (sigfile == NULL ? sigfile_name : infile_name));
+        exit(1);
+    }
+
+    // Reading from the public key file
+    mpz_t n, e, s, sig;
+    char username[1024];
+    mpz_inits(n, e, s, sig, NULL);
+    rsa_read_pub(n, e, s, username, pbfile);
+
+    // With -k only the header and the chunk's sibling path are read
+    // Otherwise the stored leaves are read and checked against the stored root
+    // Either way the root is then checked against the RSA signature
+    treehash signed_tree;
+    uint8_t path[TREEHASH_MAX_DEPTH][SHA256_DIGEST];
+    uint64_t path_len = 0;
+
+    if (check_chunk
+        && !treehash_read_proof(&signed_tree, sig, sigfile, chunk_index, path, &path_len)) {
+        fprintf(stderr, "Malformed signature file or chunk %" PRIu64 " out of range.\n",
+            chunk_index);
+        exit(1);
+    }
+
+    if (!check_chunk && !treehash_read(&signed_tree, sig, sigfile)) {
+        fprintf(stderr, "Malformed signature file.\n");
+        exit(1);
+    }
+
+    if (!treehash_verify(&signed_tree, sig, e, n)) {
+        fprintf(stderr, "Signature couldn't be verified.\n");
+        exit(1);
+    }
+
+    if (check_chunk) {
+        if (!verify_chunk(&signed_tree, iFile, chunk_index, path, path_len)) {
+            fprintf(stderr, "Chunk %" PRIu64 " couldn't be verified.\n", chunk_index);
+            exit(1);
+        }
+
+        printf("Chunk %" PRIu64 " verified.\n", chunk_index);
+    } else {
+        // Rehashes the whole file and compares its root with the signed one
+        treehash file_tree;
+
+        if (!treehash_file(&file_tree, iFile, signed_tree.chunk_size, threads)) {
+            fprintf(stderr, "Failed to hash infile.\n");
+            exit(1);
+        }
+
+        if (file_tree.count != signed_tree.count
+            || memcmp(file_tree.root, signed_tree.root, SHA256_DIGEST) != 0) {
+            fprintf(stderr, "File doesn't match its signature.\n");
+            exit(1);
+        }
+
+        treehash_clear(&file_tree);
+        printf("Signature verified.\n");
+    }
+
+    // Print verbose command-line option
+    if (print_verbose) {
+        fprintf(stderr, "chunks = %" PRIu64 "\n", signed_tree.count);
+        fprintf(stderr, "chunk size = %" PRIu64 "\n", signed_tree.chunk_size);
+    }
+
+    stats_end(run_start);
+
+    // Close the files and clear memory
+    treehash_clear(&signed_tree);
+    mpz_clears(n, e, s, sig, NULL);
+    fclose(pbfile);
+    fclose(sigfile);
+    fclose(iFile);
+}